@@ -0,0 +1,373 @@
+/*
+* Timings for the CPU side mesh code, run without a window or GL context.
+* Built with cmake -DBUILD_BENCHMARKS=ON and run as
+*   voronoi_bench [resource directory] [case ...]
+* with the cases below, all of them when none are named.
+*/
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <algorithm>
+
+#include "Terrain.h"
+#include "KdTree.h"
+#include "CellAnimation.h"
+
+#include <glm/glm.hpp>
+#include <glm/gtc/matrix_transform.hpp>
+
+typedef std::chrono::steady_clock BenchClock;
+
+static double millisecondsSince(BenchClock::time_point start)
+{
+	return std::chrono::duration<double, std::milli>(BenchClock::now() - start).count();
+}
+
+static float randomFloat(float low, float high)
+{
+	return low + (high - low) * (rand() / (float)RAND_MAX);
+}
+
+//exposes the mesh building steps the benchmarks time on their own
+class BenchTerrain: public Terrain
+{
+public:
+	void regenerateNormals()
+	{
+		norBuf.clear();
+		generateNormals();
+	}
+	size_t vertexCount() const { return posBuf.size()/3; }
+	size_t triangleCount() const { return eleBuf.size()/3; }
+};
+
+/* seeds spread over the heightmap like main.cpp places them, numAcross^2 cells of numPerArea seeds each */
+static std::vector<glm::vec3> terrainSeeds(const Terrain &terrain, int numAcross, int numPerArea)
+{
+	std::vector<float> seedX, seedZ;
+	for(int x = 0; x < numAcross; x++){
+		for(int z = 0; z < numAcross; z++){
+			for(int i = 0; i < numPerArea; i++){
+				seedX.push_back(-1 + x*(2.0/numAcross) + (randomFloat(0, 1) * 2.0/numAcross));
+				seedZ.push_back(-1 + z*(2.0/numAcross) + (randomFloat(0, 1) * 2.0/numAcross));
+			}
+		}
+	}
+	std::vector<float> seedHeights(seedX.size());
+	terrain.getHeights(&seedX[0], &seedZ[0], seedX.size(), &seedHeights[0]);
+
+	std::vector<glm::vec3> seeds;
+	for(size_t i = 0; i < seedX.size(); i++){
+		seeds.push_back(glm::vec3(seedX[i], seedHeights[i], seedZ[i]));
+	}
+	return seeds;
+}
+
+/* KdTree::nearestTwo against the linear scan it replaced, for growing seed counts */
+static void benchSeedLookup(const std::string &resourceDirectory)
+{
+	const int queries = 200000;
+	std::vector<glm::vec3> points(queries);
+	for(int i = 0; i < queries; i++){
+		points[i] = glm::vec3(randomFloat(-1, 1), randomFloat(0, 1), randomFloat(-1, 1));
+	}
+
+	for(int seedCount = 256; seedCount <= 8192; seedCount *= 4){
+		std::vector<glm::vec3> seeds(seedCount);
+		for(int i = 0; i < seedCount; i++){
+			seeds[i] = glm::vec3(randomFloat(-1, 1), randomFloat(0, 1), randomFloat(-1, 1));
+		}
+
+		BenchClock::time_point start = BenchClock::now();
+		std::vector<int> linear(queries);
+		for(int q = 0; q < queries; q++){
+			const glm::vec3 &p = points[q];
+			int best = -1;
+			float bestDist = 0;
+			for(int s = 0; s < seedCount; s++){
+				float d = (p.x-seeds[s].x)*(p.x-seeds[s].x) + (p.y-seeds[s].y)*(p.y-seeds[s].y) + (p.z-seeds[s].z)*(p.z-seeds[s].z);
+				if(best < 0 || d < bestDist){
+					best = s;
+					bestDist = d;
+				}
+			}
+			linear[q] = best;
+		}
+		double linearMs = millisecondsSince(start);
+
+		start = BenchClock::now();
+		KdTree tree;
+		tree.build(seeds);
+		int mismatches = 0;
+		for(int q = 0; q < queries; q++){
+			int first, second;
+			float firstDist, secondDist;
+			tree.nearestTwo(points[q].x, points[q].y, points[q].z, first, firstDist, second, secondDist);
+			mismatches += first != linear[q];
+		}
+		double treeMs = millisecondsSince(start);
+
+		std::cout << "seed lookup, " << seedCount << " seeds, " << queries << " queries: linear " << linearMs
+			<< " ms, k-d tree " << treeMs << " ms (" << linearMs/treeMs << "x)";
+		if(mismatches > 0){
+			std::cout << ", " << mismatches << " different seeds";
+		}
+		std::cout << std::endl;
+	}
+}
+
+/* generateVoronoi on the demo heightmap for growing seed counts */
+static void benchSplit(const std::string &resourceDirectory)
+{
+	const int perArea[] = {1, 5, 20};
+	for(int numPerArea : perArea){
+		BenchTerrain terrain;
+		terrain.loadImage(resourceDirectory + "/home_heightmap.png");
+		if(terrain.vertexCount() == 0){
+			return;
+		}
+		std::vector<glm::vec3> seeds = terrainSeeds(terrain, 20, numPerArea);
+
+		BenchClock::time_point start = BenchClock::now();
+		terrain.generateVoronoi(seeds);
+		double splitMs = millisecondsSince(start);
+
+		std::cout << "split, " << seeds.size() << " seeds: " << splitMs << " ms, "
+			<< terrain.vertexCount() << " vertices, " << terrain.triangleCount() << " triangles" << std::endl;
+	}
+}
+
+/* Shape::generateNormals over the demo heightmap's grid */
+static void benchNormals(const std::string &resourceDirectory)
+{
+	BenchTerrain terrain;
+	terrain.loadImage(resourceDirectory + "/home_heightmap.png");
+	if(terrain.vertexCount() == 0){
+		return;
+	}
+
+	const int runs = 5;
+	const unsigned int threads[] = {1, 0};
+	for(unsigned int count : threads){
+		terrain.setThreadCount(count);
+		BenchClock::time_point start = BenchClock::now();
+		for(int i = 0; i < runs; i++){
+			terrain.regenerateNormals();
+		}
+		std::cout << "normals, " << terrain.triangleCount() << " triangles, " << (count == 0 ? "all" : "1") << " threads: "
+			<< millisecondsSince(start)/runs << " ms" << std::endl;
+	}
+}
+
+/* loadImage on the demo heightmap, decode and mesh build, and loadRawHeightmap's mapping and chunk layout on a generated raw file */
+static void benchHeightmap(const std::string &resourceDirectory)
+{
+	//rolling hills as unsigned little endian 16 bit samples, rows from the top
+	const int rawSize = 2048;
+	const std::string rawPath = "voronoi_bench_heightmap.raw";
+	{
+		std::ofstream raw(rawPath, std::ios::binary);
+		std::vector<unsigned char> row(2*rawSize);
+		for(int y = 0; y < rawSize; y++){
+			for(int x = 0; x < rawSize; x++){
+				unsigned int sample = (unsigned int)((0.5 + 0.25*sin(x*0.01) + 0.25*cos(y*0.013)) * 65535);
+				row[2*x] = sample & 0xff;
+				row[2*x + 1] = sample >> 8;
+			}
+			raw.write((const char *)&row[0], row.size());
+		}
+		if(!raw){
+			std::cerr << "could not write " << rawPath << std::endl;
+			return;
+		}
+	}
+
+	const int runs = 3;
+	const unsigned int threads[] = {1, 0};
+	for(unsigned int count : threads){
+		double imageMs = 0, rawMs = 0;
+		size_t imageVertices = 0;
+		for(int i = 0; i < runs; i++){
+			BenchTerrain image;
+			image.setThreadCount(count);
+			BenchClock::time_point start = BenchClock::now();
+			image.loadImage(resourceDirectory + "/home_heightmap.png");
+			imageMs += millisecondsSince(start);
+			imageVertices = image.vertexCount();
+
+			BenchTerrain raw;
+			raw.setThreadCount(count);
+			start = BenchClock::now();
+			raw.loadRawHeightmap(rawPath, rawSize, rawSize);
+			rawMs += millisecondsSince(start);
+		}
+		std::cout << "heightmap, " << (count == 0 ? "all" : "1") << " threads: png " << imageVertices << " vertices "
+			<< imageMs/runs << " ms, raw " << rawSize << "x" << rawSize << " layout " << rawMs/runs << " ms" << std::endl;
+	}
+	std::remove(rawPath.c_str());
+}
+
+/* getHeight and getRotation one location at a time against getHeights and getRotations */
+static void benchQueries(const std::string &resourceDirectory)
+{
+	BenchTerrain terrain;
+	terrain.loadImage(resourceDirectory + "/home_heightmap.png");
+	if(terrain.vertexCount() == 0){
+		return;
+	}
+
+	const int queries = 1000000;
+	std::vector<float> xpos(queries), zpos(queries);
+	for(int i = 0; i < queries; i++){
+		xpos[i] = randomFloat(-1, 1);
+		zpos[i] = randomFloat(-1, 1);
+	}
+	glm::vec3 scale = terrain.getTerrainScale();
+
+	std::vector<float> heights(queries), batchHeights(queries);
+	BenchClock::time_point start = BenchClock::now();
+	for(int i = 0; i < queries; i++){
+		heights[i] = terrain.getHeight(xpos[i], zpos[i]);
+	}
+	double scalarMs = millisecondsSince(start);
+	start = BenchClock::now();
+	terrain.getHeights(&xpos[0], &zpos[0], queries, &batchHeights[0]);
+	double batchMs = millisecondsSince(start);
+	int mismatches = 0;
+	for(int i = 0; i < queries; i++){
+		mismatches += heights[i] != batchHeights[i];
+	}
+	std::cout << "queries, " << queries << " heights: getHeight " << scalarMs << " ms, getHeights " << batchMs
+		<< " ms, " << mismatches << " different" << std::endl;
+
+	std::vector<glm::vec2> rotations(queries), batchRotations(queries);
+	start = BenchClock::now();
+	for(int i = 0; i < queries; i++){
+		rotations[i] = terrain.getRotation(xpos[i], zpos[i], scale);
+	}
+	scalarMs = millisecondsSince(start);
+	start = BenchClock::now();
+	terrain.getRotations(&xpos[0], &zpos[0], queries, &batchRotations[0]);
+	batchMs = millisecondsSince(start);
+	float maxDifference = 0;
+	for(int i = 0; i < queries; i++){
+		maxDifference = std::max(maxDifference, std::max(std::fabs(rotations[i].x - batchRotations[i].x), std::fabs(rotations[i].y - batchRotations[i].y)));
+	}
+	std::cout << "queries, " << queries << " rotations: getRotation " << scalarMs << " ms, getRotations " << batchMs
+		<< " ms, max difference " << std::scientific << maxDifference << std::fixed << std::endl;
+}
+
+/* CellAnimationBatch, scalar and AVX2, against building each cell's matrix with RotateAnimation */
+static void benchAnimation(const std::string &resourceDirectory)
+{
+	const int cellCount = 2000;
+	const int frames = 500;
+	std::vector<struct VoronoiContainer> cells(cellCount);
+	for(struct VoronoiContainer &cell : cells){
+		cell.position = glm::vec3(randomFloat(-1, 1), randomFloat(0, 1), randomFloat(-1, 1));
+		cell.rotationAxis = glm::normalize(glm::vec3(randomFloat(-1, 1), 0.0f, randomFloat(-1, 1)));
+		cell.animationOffset = randomFloat(-10, 10);
+	}
+	//the key frames Shape::createRotateAnimation sets up
+	struct RotateAnimation anim;
+	anim.addKeyFrame(0, 0);
+	anim.addKeyFrame(1, M_PI/2);
+	anim.addKeyFrame(10, M_PI/2);
+	anim.addKeyFrame(11, 0);
+	anim.addKeyFrame(20, 0);
+	float total = anim.getTotalTime();
+
+	std::vector<glm::mat4> reference(cellCount);
+	BenchClock::time_point start = BenchClock::now();
+	for(int f = 0; f < frames; f++){
+		double time = f * 0.05;
+		for(int c = 0; c < cellCount; c++){
+			const struct VoronoiContainer &cell = cells[c];
+			glm::mat4 S = glm::translate(glm::mat4(1.0f), cell.position);
+			S = S * anim.getTransform(fmod(time + cell.animationOffset, total), cell.rotationAxis);
+			reference[c] = S * glm::translate(glm::mat4(1.0f), -cell.position);
+		}
+	}
+	double perCellUs = millisecondsSince(start) * 1000 / frames;
+
+	CellAnimationBatch batch;
+	batch.build(cells);
+	std::vector<glm::mat4> transforms(cellCount);
+	const bool simd[] = {false, true};
+	for(bool useSimd : simd){
+		batch.setUseSimd(useSimd);
+		start = BenchClock::now();
+		for(int f = 0; f < frames; f++){
+			batch.evaluate(anim.getKeyFrames(), f * 0.05, &transforms[0]);
+		}
+		double batchUs = millisecondsSince(start) * 1000 / frames;
+
+		//the last frame of both against each other
+		float maxDifference = 0;
+		for(int c = 0; c < cellCount; c++){
+			for(int col = 0; col < 4; col++){
+				for(int row = 0; row < 4; row++){
+					maxDifference = std::max(maxDifference, std::fabs(transforms[c][col][row] - reference[c][col][row]));
+				}
+			}
+		}
+		std::cout << "animation, " << cellCount << " cells: per cell " << perCellUs << " us/frame, batch " << (useSimd ? "SIMD " : "scalar ")
+			<< batchUs << " us/frame, max difference " << std::scientific << maxDifference << std::fixed << std::endl;
+	}
+}
+
+struct BenchCase
+{
+	const char *name;
+	void (*run)(const std::string &resourceDirectory);
+};
+
+static const struct BenchCase benchCases[] = {
+	{"seeds", benchSeedLookup},
+	{"split", benchSplit},
+	{"normals", benchNormals},
+	{"heightmap", benchHeightmap},
+	{"queries", benchQueries},
+	{"animation", benchAnimation}
+};
+
+static bool isCaseName(const char *name)
+{
+	for(const struct BenchCase &bench : benchCases){
+		if(strcmp(name, bench.name) == 0){
+			return true;
+		}
+	}
+	return false;
+}
+
+int main(int argc, char **argv)
+{
+	//the first argument is the resource directory unless it names a case
+	std::string resourceDir = "../resources";
+	int firstCase = 1;
+	if(argc >= 2 && !isCaseName(argv[1])){
+		resourceDir = argv[1];
+		firstCase = 2;
+	}
+
+	std::cout << std::fixed << std::setprecision(1);
+	srand(1);
+	for(const struct BenchCase &bench : benchCases){
+		bool selected = firstCase >= argc;
+		for(int i = firstCase; i < argc; i++){
+			selected = selected || strcmp(argv[i], bench.name) == 0;
+		}
+		if(selected){
+			bench.run(resourceDir);
+		}
+	}
+	return 0;
+}
@@ -2,11 +2,24 @@
 layout(location = 0) in vec4 vertPos;
 layout(location = 1) in vec3 vertNor;
 layout(location = 2) in vec2 vertTex;
+layout(location = 3) in uint vertCell;
 uniform mat4 P;
 uniform mat4 V;
 uniform mat4 M;
 uniform mat4 S;
 
+//where S comes from for voronoi cells
+//0: the S uniform
+//1: cellTransforms, 4 texels per cell holding the matrix
+//2: computed here from cellData (position + animation offset, rotation axis) and the key frames
+uniform int cellMode;
+uniform samplerBuffer cellTransforms;
+uniform samplerBuffer cellData;
+uniform float animTime;
+const int MAX_KEY_FRAMES = 16;
+uniform vec2 keyFrames[MAX_KEY_FRAMES]; //(time, rotation)
+uniform int keyFrameCount;
+
 uniform vec3 eyePos;
 
 uniform vec3 pointLightPos;
@@ -24,34 +37,80 @@ out vec3 viewVec;
 out vec2 vTexCoord;
 
 
+//same as glm::rotate(mat4(1), angle, axis)
+mat4 rotationMatrix(vec3 axis, float angle)
+{
+    axis = normalize(axis);
+    float s = sin(angle);
+    float c = cos(angle);
+    float oc = 1.0 - c;
+    
+    return mat4(oc * axis.x * axis.x + c,           oc * axis.x * axis.y + axis.z * s,  oc * axis.z * axis.x - axis.y * s,  0.0,
+                oc * axis.x * axis.y - axis.z * s,  oc * axis.y * axis.y + c,           oc * axis.y * axis.z + axis.x * s,  0.0,
+                oc * axis.z * axis.x + axis.y * s,  oc * axis.y * axis.z - axis.x * s,  oc * axis.z * axis.z + c,           0.0,
+                0.0,                                0.0,                                0.0,                                1.0);
+}
+
+//same key frame lookup as RotateAnimation::getTransform
+float keyFrameRotation(float time)
+{
+	if(time <= keyFrames[0].x){
+		return keyFrames[0].y;
+	}
+	for(int i = 0; i < keyFrameCount - 1; i++){
+		if(time > keyFrames[i].x && time < keyFrames[i+1].x){
+			float timeLerp = (time - keyFrames[i].x)/(keyFrames[i+1].x - keyFrames[i].x);
+			return (1 - timeLerp)*keyFrames[i].y + timeLerp*keyFrames[i+1].y;
+		}
+	}
+	return keyFrames[keyFrameCount-1].y;
+}
+
+mat4 cellTransform()
+{
+	if(cellMode == 0){
+		return S;
+	}
+	if(cellMode == 1){
+		int base = int(vertCell) * 4;
+		return mat4(texelFetch(cellTransforms, base),
+					texelFetch(cellTransforms, base + 1),
+					texelFetch(cellTransforms, base + 2),
+					texelFetch(cellTransforms, base + 3));
+	}
+
+	vec4 positionOffset = texelFetch(cellData, int(vertCell) * 2);
+	vec3 axis = texelFetch(cellData, int(vertCell) * 2 + 1).xyz;
+
+	//fmod, which keeps the sign of the time like the CPU path
+	float totTime = keyFrames[keyFrameCount-1].x;
+	float time = animTime + positionOffset.w;
+	time = time - totTime * trunc(time / totTime);
+
+	//move to origin, rotate, move back
+	mat4 toOrigin = mat4(1.0);
+	toOrigin[3] = vec4(-positionOffset.xyz, 1.0);
+	mat4 fromOrigin = mat4(1.0);
+	fromOrigin[3] = vec4(positionOffset.xyz, 1.0);
+	return fromOrigin * rotationMatrix(axis, keyFrameRotation(time)) * toOrigin;
+}
+
 void main()
 {
-	gl_Position = P * V * M * S * vertPos;
+	mat4 cellS = cellTransform();
+	gl_Position = P * V * M * cellS * vertPos;
 	vTexCoord = vec2(vertTex.x, vertTex.y);	
 
-	fragNor = vec3((transpose(inverse(M * S))) * vec4(vertNor, 0.0));
+	fragNor = vec3((transpose(inverse(M * cellS))) * vec4(vertNor, 0.0));
 	fragViewPos = vec3(V * M * vertPos);
 
 	//calcuate light vector for point light
-	pointLightVec = normalize(pointLightPos - (M * S *vertPos).xyz);
+	pointLightVec = normalize(pointLightPos - (M * cellS *vertPos).xyz);
 
 	//calculate specular half vector for point light
-	viewVec = normalize(eyePos - (M * S * vertPos).xyz);
+	viewVec = normalize(eyePos - (M * cellS * vertPos).xyz);
 	pointLightHalfVec = normalize(pointLightVec + viewVec);
 
 	//calculate specular half vector for directional light
 	dirLightHalfVec = normalize(normalize(dirLightVec) + viewVec);
 }
-
-mat4 rotationMatrix(vec3 axis, float angle)
-{
-    axis = normalize(axis);
-    float s = sin(angle);
-    float c = cos(angle);
-    float oc = 1.0 - c;
-    
-    return mat4(oc * axis.x * axis.x + c,           oc * axis.x * axis.y - axis.z * s,  oc * axis.z * axis.x + axis.y * s,  0.0,
-                oc * axis.x * axis.y + axis.z * s,  oc * axis.y * axis.y + c,           oc * axis.y * axis.z - axis.x * s,  0.0,
-                oc * axis.z * axis.x - axis.y * s,  oc * axis.y * axis.z + axis.x * s,  oc * axis.z * axis.z + c,           0.0,
-                0.0,                                0.0,                                0.0,                                1.0);
-}
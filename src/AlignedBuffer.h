@@ -0,0 +1,83 @@
+#pragma once
+#ifndef _ALIGNEDBUFFER_H_
+#define _ALIGNEDBUFFER_H_
+
+#include <cstdlib>
+#include <cstdint>
+#include <cstddef>
+
+/*
+* A fixed size array whose first element is aligned to Alignment bytes, for data read with SIMD loads.
+* resize() discards the contents and leaves the new elements uninitialized, so threads filling
+* their own parts are the first to touch them. Only for trivially copyable types.
+* Moves but does not copy, and frees its memory when destroyed.
+*/
+template <typename T, size_t Alignment = 32>
+class AlignedBuffer
+{
+public:
+	AlignedBuffer() : block(NULL), values(NULL), count(0) {}
+	~AlignedBuffer() { free(block); }
+
+	AlignedBuffer(AlignedBuffer &&other) : block(other.block), values(other.values), count(other.count)
+	{
+		other.block = NULL;
+		other.values = NULL;
+		other.count = 0;
+	}
+
+	AlignedBuffer &operator=(AlignedBuffer &&other)
+	{
+		if(this != &other){
+			free(block);
+			block = other.block;
+			values = other.values;
+			count = other.count;
+			other.block = NULL;
+			other.values = NULL;
+			other.count = 0;
+		}
+		return *this;
+	}
+
+	AlignedBuffer(const AlignedBuffer &) = delete;
+	AlignedBuffer &operator=(const AlignedBuffer &) = delete;
+
+	//returns false if the memory could not be allocated, the buffer is empty then
+	bool resize(size_t newCount)
+	{
+		clear();
+		if(newCount == 0){
+			return true;
+		}
+		block = malloc(newCount*sizeof(T) + Alignment - 1);
+		if(block == NULL){
+			return false;
+		}
+		values = (T *)(((uintptr_t)block + Alignment - 1) & ~(uintptr_t)(Alignment - 1));
+		count = newCount;
+		return true;
+	}
+
+	void clear()
+	{
+		free(block);
+		block = NULL;
+		values = NULL;
+		count = 0;
+	}
+
+	T *data() { return values; }
+	const T *data() const { return values; }
+	size_t size() const { return count; }
+	bool empty() const { return count == 0; }
+	T &operator[](size_t i) { return values[i]; }
+	const T &operator[](size_t i) const { return values[i]; }
+
+private:
+	void *block; //what malloc returned, values is the first aligned address in it
+	T *values;
+	size_t count;
+};
+
+#endif
@@ -0,0 +1,102 @@
+#include "AllocationCounter.h"
+
+#ifdef COUNT_ALLOCATIONS
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+static std::atomic<unsigned long long> allocations(0);
+
+static void *countedAlloc(std::size_t size)
+{
+	allocations++;
+	return std::malloc(size > 0 ? size : 1);
+}
+
+void *operator new(std::size_t size)
+{
+	void *p = countedAlloc(size);
+	if(!p){
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void *operator new[](std::size_t size)
+{
+	return operator new(size);
+}
+
+void *operator new(std::size_t size, const std::nothrow_t &) noexcept
+{
+	return countedAlloc(size);
+}
+
+void *operator new[](std::size_t size, const std::nothrow_t &) noexcept
+{
+	return countedAlloc(size);
+}
+
+void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p) noexcept
+{
+	std::free(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+void operator delete[](void *p, const std::nothrow_t &) noexcept
+{
+	std::free(p);
+}
+
+bool AllocationCounter::enabled()
+{
+	return true;
+}
+
+unsigned long long AllocationCounter::count()
+{
+	return allocations.load();
+}
+
+#else
+
+bool AllocationCounter::enabled()
+{
+	return false;
+}
+
+unsigned long long AllocationCounter::count()
+{
+	return 0;
+}
+
+#endif
+
+static unsigned long long frameStart = 0;
+static unsigned long long frameAllocations = 0;
+
+void AllocationCounter::beginFrame()
+{
+	frameStart = count();
+}
+
+unsigned long long AllocationCounter::endFrame()
+{
+	frameAllocations = count() - frameStart;
+	return frameAllocations;
+}
+
+unsigned long long AllocationCounter::lastFrame()
+{
+	return frameAllocations;
+}
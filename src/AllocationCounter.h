@@ -0,0 +1,19 @@
+#pragma once
+#ifndef _ALLOCATIONCOUNTER_H_
+#define _ALLOCATIONCOUNTER_H_
+
+/*
+* Counts heap allocations made through operator new, so the frame loop can be checked for allocations.
+* Only active when built with COUNT_ALLOCATIONS (cmake -DCOUNT_ALLOCATIONS=ON), otherwise count() is always 0.
+*/
+namespace AllocationCounter
+{
+	bool enabled();
+	unsigned long long count();
+	//brackets one frame, endFrame returns the allocations made since beginFrame and lastFrame keeps it
+	void beginFrame();
+	unsigned long long endFrame();
+	unsigned long long lastFrame();
+}
+
+#endif
@@ -0,0 +1,244 @@
+#include "CellAnimation.h"
+#include "Shape.h"
+#include <cmath>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define CELL_ANIMATION_AVX2
+#include <immintrin.h>
+#endif
+
+void CellAnimationBatch::build(const std::vector<struct VoronoiContainer> &cells)
+{
+	size_t count = cells.size();
+	px.resize(count);
+	py.resize(count);
+	pz.resize(count);
+	ax.resize(count);
+	ay.resize(count);
+	az.resize(count);
+	offset.resize(count);
+
+	for(size_t i = 0; i < count; i++){
+		//glm::rotate normalizes the axis every call, do it once here instead
+		glm::vec3 axis = glm::normalize(cells[i].rotationAxis);
+		px[i] = cells[i].position.x;
+		py[i] = cells[i].position.y;
+		pz[i] = cells[i].position.z;
+		ax[i] = axis.x;
+		ay[i] = axis.y;
+		az[i] = axis.z;
+		offset[i] = cells[i].animationOffset;
+	}
+}
+
+/*
+* wraps time + cellOffset into the animation the same way fmod does (keeping the sign)
+* baseTime is time already wrapped into [0, total) so large times keep their precision as floats
+*/
+static inline float wrapTime(double time, float baseTime, float cellOffset, float total)
+{
+	float t = baseTime + cellOffset;
+	t = t - total*std::floor(t/total);
+	if(time + cellOffset < 0 && t != 0){
+		t -= total;
+	}
+	return t;
+}
+
+//key frame search from RotateAnimation::getTransform
+static inline float keyFrameRotation(const std::vector<struct KeyFrame> &keyFrames, float time)
+{
+	if(time <= keyFrames[0].time){
+		return keyFrames[0].rotation;
+	}
+	for(size_t i = 0; i + 1 < keyFrames.size(); i++){
+		if(time > keyFrames[i].time && time < keyFrames[i+1].time){
+			float timeLerp = (time - keyFrames[i].time)/(keyFrames[i+1].time - keyFrames[i].time);
+			return (1 - timeLerp)*keyFrames[i].rotation + timeLerp*keyFrames[i+1].rotation;
+		}
+	}
+	return keyFrames.back().rotation;
+}
+
+void CellAnimationBatch::evaluate(const std::vector<struct KeyFrame> &keyFrames, double time, glm::mat4 *out) const
+{
+	size_t done = 0;
+#ifdef CELL_ANIMATION_AVX2
+	if(useSimd && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma")){
+		done = size() - size() % 8;
+		evaluateAvx2(keyFrames, time, done, out);
+	}
+#endif
+	evaluateScalar(keyFrames, time, done, size(), out);
+}
+
+void CellAnimationBatch::evaluateScalar(const std::vector<struct KeyFrame> &keyFrames, double time, size_t begin, size_t end, glm::mat4 *out) const
+{
+	float total = keyFrames.back().time;
+	float baseTime = fmod(time, (double)total);
+
+	for(size_t i = begin; i < end; i++){
+		float angle = keyFrameRotation(keyFrames, wrapTime(time, baseTime, offset[i], total));
+		float s = std::sin(angle);
+		float c = std::cos(angle);
+		float oc = 1 - c;
+		float x = ax[i], y = ay[i], z = az[i];
+
+		//rotation part, same layout as glm::rotate
+		glm::mat4 &m = out[i];
+		m[0] = glm::vec4(c + oc*x*x, oc*x*y + s*z, oc*x*z - s*y, 0);
+		m[1] = glm::vec4(oc*x*y - s*z, c + oc*y*y, oc*y*z + s*x, 0);
+		m[2] = glm::vec4(oc*x*z + s*y, oc*y*z - s*x, c + oc*z*z, 0);
+
+		//translate(p) * R * translate(-p) moves the origin to p - R*p
+		m[3] = glm::vec4(px[i] - (m[0][0]*px[i] + m[1][0]*py[i] + m[2][0]*pz[i]),
+			py[i] - (m[0][1]*px[i] + m[1][1]*py[i] + m[2][1]*pz[i]),
+			pz[i] - (m[0][2]*px[i] + m[1][2]*py[i] + m[2][2]*pz[i]),
+			1);
+	}
+}
+
+#ifdef CELL_ANIMATION_AVX2
+
+//sin and cos of 8 floats at once, cephes polynomials as used by sse_mathfun
+__attribute__((target("avx2,fma")))
+static inline void sincos8(__m256 x, __m256 &sinOut, __m256 &cosOut)
+{
+	const __m256 signMask = _mm256_castsi256_ps(_mm256_set1_epi32(0x80000000));
+	__m256 signSin = _mm256_and_ps(x, signMask);
+	x = _mm256_andnot_ps(signMask, x);
+
+	//reduce to [-pi/4, pi/4] and find which octant we were in
+	__m256 y = _mm256_mul_ps(x, _mm256_set1_ps(1.27323954473516f));
+	__m256i j = _mm256_cvttps_epi32(y);
+	j = _mm256_and_si256(_mm256_add_epi32(j, _mm256_set1_epi32(1)), _mm256_set1_epi32(~1));
+	y = _mm256_cvtepi32_ps(j);
+
+	__m256 swapSignSin = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(j, _mm256_set1_epi32(4)), 29));
+	__m256 polyMask = _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(j, _mm256_set1_epi32(2)), _mm256_setzero_si256()));
+	__m256i jc = _mm256_sub_epi32(j, _mm256_set1_epi32(2));
+	__m256 signCos = _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_andnot_si256(jc, _mm256_set1_epi32(4)), 29));
+	signSin = _mm256_xor_ps(signSin, swapSignSin);
+
+	x = _mm256_fmadd_ps(y, _mm256_set1_ps(-0.78515625f), x);
+	x = _mm256_fmadd_ps(y, _mm256_set1_ps(-2.4187564849853515625e-4f), x);
+	x = _mm256_fmadd_ps(y, _mm256_set1_ps(-3.77489497744594108e-8f), x);
+	__m256 z = _mm256_mul_ps(x, x);
+
+	__m256 polyCos = _mm256_set1_ps(2.443315711809948e-5f);
+	polyCos = _mm256_fmadd_ps(polyCos, z, _mm256_set1_ps(-1.388731625493765e-3f));
+	polyCos = _mm256_fmadd_ps(polyCos, z, _mm256_set1_ps(4.166664568298827e-2f));
+	polyCos = _mm256_mul_ps(_mm256_mul_ps(polyCos, z), z);
+	polyCos = _mm256_fnmadd_ps(z, _mm256_set1_ps(0.5f), polyCos);
+	polyCos = _mm256_add_ps(polyCos, _mm256_set1_ps(1.0f));
+
+	__m256 polySin = _mm256_set1_ps(-1.9515295891e-4f);
+	polySin = _mm256_fmadd_ps(polySin, z, _mm256_set1_ps(8.3321608736e-3f));
+	polySin = _mm256_fmadd_ps(polySin, z, _mm256_set1_ps(-1.6666654611e-1f));
+	polySin = _mm256_fmadd_ps(_mm256_mul_ps(polySin, z), x, x);
+
+	sinOut = _mm256_xor_ps(_mm256_blendv_ps(polyCos, polySin, polyMask), signSin);
+	cosOut = _mm256_xor_ps(_mm256_blendv_ps(polySin, polyCos, polyMask), signCos);
+}
+
+//transposes one matrix column (x, y, z, w) for 8 cells and writes it to each cell's matrix
+__attribute__((target("avx2,fma")))
+static inline void storeColumn8(__m256 x, __m256 y, __m256 z, __m256 w, glm::mat4 *out, int column)
+{
+	__m256 xy0 = _mm256_unpacklo_ps(x, y);
+	__m256 xy1 = _mm256_unpackhi_ps(x, y);
+	__m256 zw0 = _mm256_unpacklo_ps(z, w);
+	__m256 zw1 = _mm256_unpackhi_ps(z, w);
+	__m256 c0 = _mm256_shuffle_ps(xy0, zw0, 0x44); //cells 0 and 4
+	__m256 c1 = _mm256_shuffle_ps(xy0, zw0, 0xEE); //cells 1 and 5
+	__m256 c2 = _mm256_shuffle_ps(xy1, zw1, 0x44); //cells 2 and 6
+	__m256 c3 = _mm256_shuffle_ps(xy1, zw1, 0xEE); //cells 3 and 7
+	_mm_storeu_ps(&out[0][column][0], _mm256_castps256_ps128(c0));
+	_mm_storeu_ps(&out[1][column][0], _mm256_castps256_ps128(c1));
+	_mm_storeu_ps(&out[2][column][0], _mm256_castps256_ps128(c2));
+	_mm_storeu_ps(&out[3][column][0], _mm256_castps256_ps128(c3));
+	_mm_storeu_ps(&out[4][column][0], _mm256_extractf128_ps(c0, 1));
+	_mm_storeu_ps(&out[5][column][0], _mm256_extractf128_ps(c1, 1));
+	_mm_storeu_ps(&out[6][column][0], _mm256_extractf128_ps(c2, 1));
+	_mm_storeu_ps(&out[7][column][0], _mm256_extractf128_ps(c3, 1));
+}
+
+__attribute__((target("avx2,fma")))
+void CellAnimationBatch::evaluateAvx2(const std::vector<struct KeyFrame> &keyFrames, double time, size_t end, glm::mat4 *out) const
+{
+	float total = keyFrames.back().time;
+	float baseTime = fmod(time, (double)total);
+	const __m256 totalV = _mm256_set1_ps(total);
+	const __m256 baseTimeV = _mm256_set1_ps(baseTime);
+	const __m256 negTimeV = _mm256_set1_ps((float)-time);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 one = _mm256_set1_ps(1.0f);
+
+	for(size_t i = 0; i < end; i += 8){
+		//wrap the time into the animation like wrapTime
+		__m256 cellOffset = _mm256_loadu_ps(&offset[i]);
+		__m256 t = _mm256_add_ps(baseTimeV, cellOffset);
+		t = _mm256_fnmadd_ps(totalV, _mm256_floor_ps(_mm256_div_ps(t, totalV)), t);
+		__m256 negative = _mm256_and_ps(_mm256_cmp_ps(cellOffset, negTimeV, _CMP_LT_OQ), _mm256_cmp_ps(t, zero, _CMP_NEQ_OQ));
+		t = _mm256_blendv_ps(t, _mm256_sub_ps(t, totalV), negative);
+
+		//key frame search, later segments first so the earliest match wins like the scalar search
+		__m256 angle = _mm256_set1_ps(keyFrames.back().rotation);
+		for(size_t k = keyFrames.size() - 1; k-- > 0; ){
+			__m256 t0 = _mm256_set1_ps(keyFrames[k].time);
+			__m256 t1 = _mm256_set1_ps(keyFrames[k+1].time);
+			__m256 inSegment = _mm256_and_ps(_mm256_cmp_ps(t, t0, _CMP_GT_OQ), _mm256_cmp_ps(t, t1, _CMP_LT_OQ));
+			__m256 timeLerp = _mm256_div_ps(_mm256_sub_ps(t, t0), _mm256_sub_ps(t1, t0));
+			__m256 rotation = _mm256_fmadd_ps(_mm256_sub_ps(one, timeLerp), _mm256_set1_ps(keyFrames[k].rotation),
+				_mm256_mul_ps(timeLerp, _mm256_set1_ps(keyFrames[k+1].rotation)));
+			angle = _mm256_blendv_ps(angle, rotation, inSegment);
+		}
+		__m256 beforeStart = _mm256_cmp_ps(t, _mm256_set1_ps(keyFrames[0].time), _CMP_LE_OQ);
+		angle = _mm256_blendv_ps(angle, _mm256_set1_ps(keyFrames[0].rotation), beforeStart);
+
+		__m256 s, c;
+		sincos8(angle, s, c);
+		__m256 oc = _mm256_sub_ps(one, c);
+		__m256 x = _mm256_loadu_ps(&ax[i]);
+		__m256 y = _mm256_loadu_ps(&ay[i]);
+		__m256 z = _mm256_loadu_ps(&az[i]);
+		__m256 ocx = _mm256_mul_ps(oc, x);
+		__m256 ocy = _mm256_mul_ps(oc, y);
+		__m256 ocz = _mm256_mul_ps(oc, z);
+
+		//rotation part, same layout as glm::rotate
+		__m256 m00 = _mm256_fmadd_ps(ocx, x, c);
+		__m256 m01 = _mm256_fmadd_ps(ocx, y, _mm256_mul_ps(s, z));
+		__m256 m02 = _mm256_fmsub_ps(ocx, z, _mm256_mul_ps(s, y));
+		__m256 m10 = _mm256_fmsub_ps(ocx, y, _mm256_mul_ps(s, z));
+		__m256 m11 = _mm256_fmadd_ps(ocy, y, c);
+		__m256 m12 = _mm256_fmadd_ps(ocy, z, _mm256_mul_ps(s, x));
+		__m256 m20 = _mm256_fmadd_ps(ocx, z, _mm256_mul_ps(s, y));
+		__m256 m21 = _mm256_fmsub_ps(ocy, z, _mm256_mul_ps(s, x));
+		__m256 m22 = _mm256_fmadd_ps(ocz, z, c);
+
+		//translate(p) * R * translate(-p) moves the origin to p - R*p
+		__m256 p0 = _mm256_loadu_ps(&px[i]);
+		__m256 p1 = _mm256_loadu_ps(&py[i]);
+		__m256 p2 = _mm256_loadu_ps(&pz[i]);
+		__m256 m30 = _mm256_sub_ps(p0, _mm256_fmadd_ps(m00, p0, _mm256_fmadd_ps(m10, p1, _mm256_mul_ps(m20, p2))));
+		__m256 m31 = _mm256_sub_ps(p1, _mm256_fmadd_ps(m01, p0, _mm256_fmadd_ps(m11, p1, _mm256_mul_ps(m21, p2))));
+		__m256 m32 = _mm256_sub_ps(p2, _mm256_fmadd_ps(m02, p0, _mm256_fmadd_ps(m12, p1, _mm256_mul_ps(m22, p2))));
+
+		__m256 w0 = _mm256_setzero_ps();
+		__m256 w1 = _mm256_set1_ps(1.0f);
+		storeColumn8(m00, m01, m02, w0, out + i, 0);
+		storeColumn8(m10, m11, m12, w0, out + i, 1);
+		storeColumn8(m20, m21, m22, w0, out + i, 2);
+		storeColumn8(m30, m31, m32, w1, out + i, 3);
+	}
+}
+
+#else
+
+void CellAnimationBatch::evaluateAvx2(const std::vector<struct KeyFrame> &keyFrames, double time, size_t end, glm::mat4 *out) const
+{
+	evaluateScalar(keyFrames, time, 0, end, out);
+}
+
+#endif
@@ -0,0 +1,39 @@
+#pragma once
+#ifndef _CELLANIMATION_H_
+#define _CELLANIMATION_H_
+
+#include <vector>
+#include <glm/glm.hpp>
+
+struct VoronoiContainer;
+struct KeyFrame;
+
+/*
+* Evaluates the rotate animation for every voronoi cell at once.
+* Cell data is kept as a structure of arrays so 8 cells can be done per step with AVX2,
+* with a scalar path for other CPUs and for the cells left over at the end.
+* Output is one S matrix per cell, laid out back to back ready to upload.
+*/
+class CellAnimationBatch
+{
+public:
+	void build(const std::vector<struct VoronoiContainer> &cells);
+	size_t size() const { return offset.size(); }
+
+	//same result as translate(position) * RotateAnimation::getTransform(fmod(time + offset, total), axis) * translate(-position)
+	void evaluate(const std::vector<struct KeyFrame> &keyFrames, double time, glm::mat4 *out) const;
+
+	//forces the scalar path, used to compare the two
+	void setUseSimd(bool use) { useSimd = use; }
+
+private:
+	std::vector<float> px, py, pz; //cell position
+	std::vector<float> ax, ay, az; //normalized rotation axis
+	std::vector<float> offset; //animation offset
+	bool useSimd = true;
+
+	void evaluateScalar(const std::vector<struct KeyFrame> &keyFrames, double time, size_t begin, size_t end, glm::mat4 *out) const;
+	void evaluateAvx2(const std::vector<struct KeyFrame> &keyFrames, double time, size_t end, glm::mat4 *out) const;
+};
+
+#endif
@@ -0,0 +1,62 @@
+#pragma once
+#ifndef _FRUSTUM_H_
+#define _FRUSTUM_H_
+
+#include <glm/glm.hpp>
+
+/*
+* The six planes of a view frustum, taken from the rows of a clip matrix (Gribb and Hartmann).
+* Built from P*V*M the planes are in the model's object space, so object space bounds can be tested directly.
+* Plane normals point into the frustum and are normalized, so plane distances are object space distances.
+*/
+struct Frustum
+{
+	glm::vec4 planes[6];
+
+	void extract(const glm::mat4 &clip)
+	{
+		//glm matrices are column major, clip[column][row]
+		glm::vec4 rows[4];
+		for(int r = 0; r < 4; r++){
+			rows[r] = glm::vec4(clip[0][r], clip[1][r], clip[2][r], clip[3][r]);
+		}
+		planes[0] = rows[3] + rows[0]; //left
+		planes[1] = rows[3] - rows[0]; //right
+		planes[2] = rows[3] + rows[1]; //bottom
+		planes[3] = rows[3] - rows[1]; //top
+		planes[4] = rows[3] + rows[2]; //near
+		planes[5] = rows[3] - rows[2]; //far
+		for(int i = 0; i < 6; i++){
+			planes[i] = planes[i] / glm::length(glm::vec3(planes[i]));
+		}
+	}
+
+	//false only when the box is completely behind one of the planes, so a few boxes near corners pass that could be culled
+	bool intersectsBox(const glm::vec3 &min, const glm::vec3 &max) const
+	{
+		for(int i = 0; i < 6; i++){
+			const glm::vec4 &p = planes[i];
+			//the corner furthest along the plane normal
+			float x = p.x >= 0 ? max.x : min.x;
+			float y = p.y >= 0 ? max.y : min.y;
+			float z = p.z >= 0 ? max.z : min.z;
+			if(p.x*x + p.y*y + p.z*z + p.w < 0){
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool intersectsSphere(const glm::vec3 &center, float radius) const
+	{
+		for(int i = 0; i < 6; i++){
+			const glm::vec4 &p = planes[i];
+			if(p.x*center.x + p.y*center.y + p.z*center.z + p.w < -radius){
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+#endif
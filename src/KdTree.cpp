@@ -0,0 +1,107 @@
+#include "KdTree.h"
+#include <algorithm>
+
+void KdTree::build(const std::vector<glm::vec3> &newPoints)
+{
+	points = newPoints;
+	order.resize(points.size());
+	axis.resize(points.size());
+	for(unsigned int i = 0; i < order.size(); i++){
+		order[i] = i;
+	}
+
+	buildRange(0, order.size());
+}
+
+void KdTree::clear()
+{
+	points.clear();
+	order.clear();
+	axis.clear();
+}
+
+//split the range at its median along the axis with the largest extent
+void KdTree::buildRange(unsigned int lo, unsigned int hi)
+{
+	if(hi - lo < 2){
+		return;
+	}
+
+	glm::vec3 low = points[order[lo]];
+	glm::vec3 high = points[order[lo]];
+	for(unsigned int i = lo + 1; i < hi; i++){
+		low = glm::min(low, points[order[i]]);
+		high = glm::max(high, points[order[i]]);
+	}
+	glm::vec3 extent = high - low;
+	unsigned char a = 0;
+	if(extent.y > extent[a]) a = 1;
+	if(extent.z > extent[a]) a = 2;
+
+	unsigned int mid = (lo + hi) / 2;
+	const std::vector<glm::vec3> &pts = points;
+	std::nth_element(order.begin() + lo, order.begin() + mid, order.begin() + hi,
+		[&pts, a](unsigned int p1, unsigned int p2) { return pts[p1][a] < pts[p2][a]; });
+	axis[mid] = a;
+
+	buildRange(lo, mid);
+	buildRange(mid + 1, hi);
+}
+
+void KdTree::nearestTwo(float x, float y, float z, int &first, float &firstDist, int &second, float &secondDist) const
+{
+	int best[2] = {-1, -1};
+	float bestDist[2] = {0, 0};
+	searchRangeTwo(0, order.size(), x, y, z, best, bestDist);
+	first = best[0];
+	firstDist = bestDist[0];
+	second = best[1];
+	secondDist = bestDist[1];
+}
+
+//keeps the two closest points in best[0] and best[1], ties go to the lowest index
+void KdTree::searchRangeTwo(unsigned int lo, unsigned int hi, float x, float y, float z, int *best, float *bestDist) const
+{
+	if(lo >= hi){
+		return;
+	}
+
+	unsigned int mid = (lo + hi) / 2;
+	int index = order[mid];
+	const glm::vec3 &p = points[index];
+
+	//same expression as the linear scan so the chosen seed is bit for bit identical
+	float d = (x-p.x)*(x-p.x) + (y-p.y)*(y-p.y) + (z-p.z)*(z-p.z);
+	if(best[0] < 0 || d < bestDist[0] || (d == bestDist[0] && index < best[0])){
+		best[1] = best[0];
+		bestDist[1] = bestDist[0];
+		best[0] = index;
+		bestDist[0] = d;
+	}
+	else if(best[1] < 0 || d < bestDist[1] || (d == bestDist[1] && index < best[1])){
+		best[1] = index;
+		bestDist[1] = d;
+	}
+
+	if(hi - lo == 1){
+		return;
+	}
+
+	unsigned char a = axis[mid];
+	float q = (a == 0) ? x : ((a == 1) ? y : z);
+	float diff = q - p[a];
+
+	//the far side is needed until two points are found, after that only if it could beat the runner up
+	if(diff < 0){
+		searchRangeTwo(lo, mid, x, y, z, best, bestDist);
+		if(best[1] < 0 || diff*diff <= bestDist[1]){
+			searchRangeTwo(mid + 1, hi, x, y, z, best, bestDist);
+		}
+	}
+	else{
+		searchRangeTwo(mid + 1, hi, x, y, z, best, bestDist);
+		if(best[1] < 0 || diff*diff <= bestDist[1]){
+			searchRangeTwo(lo, mid, x, y, z, best, bestDist);
+		}
+	}
+}
@@ -0,0 +1,34 @@
+#pragma once
+#ifndef _KDTREE_H_
+#define _KDTREE_H_
+
+#include <vector>
+#include <glm/glm.hpp>
+
+/*
+* Static k-d tree over a set of 3D points, used to find the closest voronoi seed
+* for a position without scanning every seed.
+* The tree is stored implicitly: each range [lo, hi) of order has its splitting
+* point at the middle, with the left half below it and the right half above it.
+*/
+class KdTree
+{
+public:
+	void build(const std::vector<glm::vec3> &points);
+	void clear();
+	size_t size() const { return points.size(); }
+
+	//indices of the points closest and second closest to (x, y, z), -1 where there are not enough points
+	//ties go to the lowest index so results match a linear scan, distances are squared
+	void nearestTwo(float x, float y, float z, int &first, float &firstDist, int &second, float &secondDist) const;
+
+private:
+	std::vector<glm::vec3> points;
+	std::vector<unsigned int> order;
+	std::vector<unsigned char> axis;
+
+	void buildRange(unsigned int lo, unsigned int hi);
+	void searchRangeTwo(unsigned int lo, unsigned int hi, float x, float y, float z, int *best, float *bestDist) const;
+};
+
+#endif
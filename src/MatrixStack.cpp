@@ -2,74 +2,72 @@
 #include "MatrixStack.h"
 #include <glm/gtc/matrix_transform.hpp>
 #include <stdio.h>
+#include <cassert>
 
-static const int MaxMatrixSize = 100;
 
-
-MatrixStack::MatrixStack()
+MatrixStack::MatrixStack() :
+	topIndex(0)
 {
-	stack.push(glm::mat4(1.0));
+	stack[0] = glm::mat4(1.0);
 }
 
 void MatrixStack::pushMatrix()
 {
-	const glm::mat4 &top = stack.top();
-	stack.push(top);
-	assert(stack.size() < MaxMatrixSize);
+	assert(topIndex + 1 < MaxMatrixSize);
+	stack[topIndex + 1] = stack[topIndex];
+	topIndex++;
 }
 
 void MatrixStack::popMatrix()
 {
-	assert(!stack.empty());
-	stack.pop();
-
 	// There should always be one matrix left.
-	assert(!stack.empty());
+	assert(topIndex > 0);
+	topIndex--;
 }
 
 void MatrixStack::loadIdentity()
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	top = glm::mat4(1.f);
 }
 
  void MatrixStack::perspective(float fovy, float aspect, float zNear, float zFar)
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	top *= glm::perspective(fovy, aspect, zNear, zFar);
 }
 
 void MatrixStack::translate(const glm::vec3 &offset)
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	glm::mat4 t = glm::translate(glm::mat4(1.f), offset);
 	top *= t;
 }
 
 void MatrixStack::scale(const glm::vec3 &scaleV)
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	glm::mat4 s = glm::scale(glm::mat4(1.f), scaleV);
 	top *= s;
 }
 
 void MatrixStack::scale(float size)
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	glm::mat4 s = glm::scale(glm::mat4(1.f), glm::vec3(size));
 	top *= s;
 }
 
 void MatrixStack::rotate(float angle, const glm::vec3 &axis)
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	glm::mat4 r = glm::rotate(glm::mat4(1.0), angle, axis);
 	top *= r;
 }
 
 void MatrixStack::multMatrix(const glm::mat4 &matrix)
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	top *= matrix;
 }
 
@@ -79,25 +77,25 @@ void MatrixStack::ortho(float left, float right, float bottom, float top, float
 	assert(bottom != top);
 	assert(zFar != zNear);
 
-	glm::mat4 &ctm = stack.top();
+	glm::mat4 &ctm = stack[topIndex];
 	ctm *= glm::ortho(left, right, bottom, top, zNear, zFar);
 }
 
 void MatrixStack::frustum(float left, float right, float bottom, float top, float zNear, float zFar)
 {
-	glm::mat4 &ctm = stack.top();
+	glm::mat4 &ctm = stack[topIndex];
 	ctm *= glm::frustum(left, right, bottom, top, zNear, zFar);
 }
 
 void MatrixStack::lookAt(const glm::vec3 &eye, const glm::vec3 &target, const glm::vec3 &up)
 {
-	glm::mat4 &top = stack.top();
+	glm::mat4 &top = stack[topIndex];
 	top *= glm::lookAt(eye, target, up);
 }
 
 const glm::mat4 &MatrixStack::topMatrix() const
 {
-	return stack.top();
+	return stack[topIndex];
 }
 
 void MatrixStack::print(const glm::mat4 &mat, const char *name)
@@ -125,5 +123,5 @@ void MatrixStack::print(const glm::mat4 &mat, const char *name)
 
 void MatrixStack::print(const char *name) const
 {
-	print(stack.top(), name);
+	print(stack[topIndex], name);
 }
@@ -3,7 +3,6 @@
 #ifndef LAB471_MATRIXSTACK_H_INCLUDED
 #define LAB471_MATRIXSTACK_H_INCLUDED
 
-#include <stack>
 #include <memory>
 
 #include <glm/glm.hpp>
@@ -15,7 +14,15 @@
 class MatrixStack
 {
 
-	std::stack<glm::mat4> stack;
+public:
+
+	static const int MaxMatrixSize = 100;
+
+private:
+
+	// Fixed size so pushing and popping never touches the heap
+	glm::mat4 stack[MaxMatrixSize];
+	int topIndex;
 
 public:
 
@@ -0,0 +1,162 @@
+#include "MeshCache.h"
+#include <fstream>
+#include <vector>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+static const uint64_t FnvOffsetBasis = 14695981039346656037ULL;
+static const uint64_t FnvPrime = 1099511628211ULL;
+
+MeshCacheKey::MeshCacheKey() :
+	hash(FnvOffsetBasis)
+{
+	addBytes(&MeshCacheVersion, sizeof(MeshCacheVersion));
+}
+
+void MeshCacheKey::addBytes(const void *data, size_t size)
+{
+	const unsigned char *bytes = (const unsigned char *)data;
+	for(size_t i = 0; i < size; i++){
+		hash ^= bytes[i];
+		hash *= FnvPrime;
+	}
+}
+
+bool MeshCacheKey::addFile(const std::string &path)
+{
+	std::ifstream in(path.c_str(), std::ios::binary);
+	if(!in){
+		return false;
+	}
+	std::vector<char> block(1 << 16);
+	while(in){
+		in.read(&block[0], block.size());
+		addBytes(&block[0], (size_t)in.gcount());
+	}
+	//reading stops at the end of the file or at an error
+	return !in.bad();
+}
+
+void MeshCacheKey::addFunction(float (*func)(float distance))
+{
+	for(int i = 0; i <= 128; i++){
+		float value = func(i / 16.0f);
+		addBytes(&value, sizeof(value));
+	}
+}
+
+size_t meshCacheSectionSize(const struct MeshCacheHeader &header, int section)
+{
+	size_t vertices = (size_t)header.vertexCount;
+	switch(section){
+		case MESH_CACHE_POSITIONS:
+		case MESH_CACHE_NORMALS:
+			return 3 * vertices * sizeof(float);
+		case MESH_CACHE_TEXCOORDS_SECTION:
+			return (header.flags & MESH_CACHE_TEXCOORDS) ? 2 * vertices * sizeof(float) : 0;
+		case MESH_CACHE_CELL_INDICES:
+			return vertices * sizeof(uint32_t);
+		case MESH_CACHE_ELEMENTS:
+			return (size_t)header.indexCount * ((header.flags & MESH_CACHE_SHORT_INDICES) ? sizeof(uint16_t) : sizeof(uint32_t));
+		case MESH_CACHE_CELLS:
+			return (size_t)header.cellCount * sizeof(struct MeshCacheCell);
+		case MESH_CACHE_ADJACENCY_OFFSETS:
+			return ((size_t)header.cellCount + 1) * sizeof(uint32_t);
+		case MESH_CACHE_ADJACENCY_CELLS:
+			return (size_t)header.adjacencyCount * sizeof(uint32_t);
+	}
+	return 0;
+}
+
+MappedFile::MappedFile() :
+	view(NULL),
+	length(0)
+#ifdef _WIN32
+	, file(INVALID_HANDLE_VALUE),
+	mapping(NULL)
+#endif
+{
+}
+
+MappedFile::~MappedFile()
+{
+	close();
+}
+
+/* maps the whole file, returns false if it does not exist, is empty or cannot be mapped */
+bool MappedFile::open(const std::string &path)
+{
+	close();
+#ifdef _WIN32
+	file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if(file == INVALID_HANDLE_VALUE){
+		return false;
+	}
+	LARGE_INTEGER fileSize;
+	if(!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0){
+		close();
+		return false;
+	}
+	mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+	if(mapping == NULL){
+		close();
+		return false;
+	}
+	view = (const unsigned char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+	if(view == NULL){
+		close();
+		return false;
+	}
+	length = (size_t)fileSize.QuadPart;
+#else
+	int fd = ::open(path.c_str(), O_RDONLY);
+	if(fd < 0){
+		return false;
+	}
+	struct stat info;
+	if(fstat(fd, &info) != 0 || info.st_size == 0){
+		::close(fd);
+		return false;
+	}
+	void *mapped = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	//the mapping keeps the file open on its own
+	::close(fd);
+	if(mapped == MAP_FAILED){
+		return false;
+	}
+	view = (const unsigned char *)mapped;
+	length = (size_t)info.st_size;
+#endif
+	return true;
+}
+
+void MappedFile::close()
+{
+#ifdef _WIN32
+	if(view != NULL){
+		UnmapViewOfFile(view);
+	}
+	if(mapping != NULL){
+		CloseHandle(mapping);
+	}
+	if(file != INVALID_HANDLE_VALUE){
+		CloseHandle(file);
+	}
+	mapping = NULL;
+	file = INVALID_HANDLE_VALUE;
+#else
+	if(view != NULL){
+		munmap((void *)view, length);
+	}
+#endif
+	view = NULL;
+	length = 0;
+}
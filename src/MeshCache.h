@@ -0,0 +1,116 @@
+#pragma once
+#ifndef _MESHCACHE_H_
+#define _MESHCACHE_H_
+
+#include <string>
+#include <cstdint>
+#include <cstddef>
+
+/*
+* Binary cache of a fractured mesh, written by Shape::saveVoronoiCache and mapped by Shape::loadVoronoiCache.
+* A header, then each section at a 16 byte aligned offset the header records:
+* vertex positions, normals and texcoords (floats), vertex cell indices, element indices
+* (16 bit relative to each cell's base vertex when MESH_CACHE_SHORT_INDICES is set, else 32 bit),
+* one MeshCacheCell per cell and the cell adjacency arrays.
+* Everything is in the byte order of the machine that wrote it.
+* Bump MeshCacheVersion whenever the layout or the meshes generateVoronoi makes change.
+*/
+static const uint32_t MeshCacheVersion = 1;
+static const char MeshCacheMagic[8] = {'V', 'O', 'R', 'O', 'M', 'E', 'S', 'H'};
+//reads back differently on a machine of the other byte order
+static const uint32_t MeshCacheByteOrder = 0x01020304;
+
+enum MeshCacheFlags
+{
+	MESH_CACHE_TEXCOORDS = 1,
+	MESH_CACHE_SHORT_INDICES = 2
+};
+
+enum MeshCacheSection
+{
+	MESH_CACHE_POSITIONS,
+	MESH_CACHE_NORMALS,
+	MESH_CACHE_TEXCOORDS_SECTION,
+	MESH_CACHE_CELL_INDICES,
+	MESH_CACHE_ELEMENTS,
+	MESH_CACHE_CELLS,
+	MESH_CACHE_ADJACENCY_OFFSETS,
+	MESH_CACHE_ADJACENCY_CELLS,
+	MESH_CACHE_SECTION_COUNT
+};
+
+struct MeshCacheHeader
+{
+	char magic[8];
+	uint32_t version;
+	uint32_t byteOrder;
+	uint64_t key;
+	uint32_t flags;
+	uint32_t cellCount;
+	uint64_t vertexCount;
+	uint64_t indexCount;
+	uint64_t adjacencyCount;
+	uint64_t sections[MESH_CACHE_SECTION_COUNT]; //byte offset of each section from the start of the file
+};
+
+//one VoronoiContainer, without glm types so the layout does not depend on them
+struct MeshCacheCell
+{
+	float position[3];
+	uint32_t indexOffset;
+	uint32_t indexCount;
+	uint32_t baseVertex;
+	uint32_t vertexCount;
+	float boundRadius;
+	float rotationAxis[3];
+	float animationOffset;
+	float normal[3];
+	float vecToMaster[3];
+};
+
+/*
+* 64 bit FNV-1a hash of everything a cached mesh was made from.
+* Add the same inputs in the same order when saving and loading.
+*/
+class MeshCacheKey
+{
+public:
+	MeshCacheKey();
+	void addBytes(const void *data, size_t size);
+	//the file's contents, returns false if it could not be read
+	bool addFile(const std::string &path);
+	//a function of distance, by its values at distances 0 to 8 in steps of 1/16
+	void addFunction(float (*func)(float distance));
+	uint64_t value() const { return hash; }
+
+private:
+	uint64_t hash;
+};
+
+/* a read only view of a whole file, unmapped when closed or destroyed */
+class MappedFile
+{
+public:
+	MappedFile();
+	~MappedFile();
+	MappedFile(const MappedFile &) = delete;
+	MappedFile &operator=(const MappedFile &) = delete;
+	bool open(const std::string &path);
+	void close();
+	const unsigned char *data() const { return view; }
+	size_t size() const { return length; }
+
+private:
+	const unsigned char *view;
+	size_t length;
+#ifdef _WIN32
+	void *file;
+	void *mapping;
+#endif
+};
+
+//size in bytes of a section for the counts and flags in header
+//the counts must already be known to fit the file, or the size can overflow
+size_t meshCacheSectionSize(const struct MeshCacheHeader &header, int section);
+
+#endif
@@ -0,0 +1,190 @@
+#include "MeshOptimizer.h"
+#include <cmath>
+
+//scoring constants from Forsyth's article
+static const float CacheDecayPower = 1.5f;
+static const float LastTriScore = 0.75f;
+static const float ValenceBoostScale = 2.0f;
+static const float ValenceBoostPower = 0.5f;
+
+//vertices with more remaining triangles than this all get the same valence boost
+static const unsigned int MaxValence = 32;
+
+//vertices in the cache score higher the more recently they were used, vertices with few triangles left score higher so they get finished off
+//the terms are looked up from tables since this runs for every vertex in the cache after every triangle
+struct VertexScoreTable
+{
+	float cache[VertexCacheSize];
+	float valence[MaxValence+1];
+
+	VertexScoreTable()
+	{
+		for(unsigned int i = 0; i < VertexCacheSize; i++){
+			if(i < 3){
+				//the last triangle's vertices are scored lower so the order does not just turn back on itself
+				cache[i] = LastTriScore;
+			}
+			else{
+				float scaler = 1.0f / (VertexCacheSize - 3);
+				cache[i] = powf(1.0f - (i - 3) * scaler, CacheDecayPower);
+			}
+		}
+		valence[0] = 0.0f;
+		for(unsigned int i = 1; i <= MaxValence; i++){
+			valence[i] = ValenceBoostScale * powf((float)i, -ValenceBoostPower);
+		}
+	}
+
+	float score(int cachePos, unsigned int remaining) const
+	{
+		if(remaining == 0){
+			return -1.0f;
+		}
+		float score = cachePos >= 0 ? cache[cachePos] : 0.0f;
+		return score + valence[remaining < MaxValence ? remaining : MaxValence];
+	}
+};
+
+void optimizeVertexCache(std::vector<unsigned int> &indices, unsigned int vertexCount)
+{
+	size_t triCount = indices.size()/3;
+	if(triCount == 0){
+		return;
+	}
+
+	//triangles using each vertex, the first remaining[v] entries of a vertex's list are the ones not emitted yet
+	std::vector<unsigned int> remaining(vertexCount, 0);
+	for(unsigned int v : indices){
+		remaining[v]++;
+	}
+	std::vector<unsigned int> triOffset(vertexCount+1, 0);
+	for(unsigned int v = 0; v < vertexCount; v++){
+		triOffset[v+1] = triOffset[v] + remaining[v];
+	}
+	std::vector<unsigned int> vertTris(indices.size());
+	std::vector<unsigned int> fill(triOffset.begin(), triOffset.end()-1);
+	for(size_t i = 0; i < indices.size(); i++){
+		vertTris[fill[indices[i]]++] = i/3;
+	}
+
+	static const struct VertexScoreTable scoreTable;
+	std::vector<int> cachePos(vertexCount, -1);
+	std::vector<float> vertScore(vertexCount);
+	for(unsigned int v = 0; v < vertexCount; v++){
+		vertScore[v] = scoreTable.score(-1, remaining[v]);
+	}
+
+	std::vector<float> triScore(triCount);
+	std::vector<char> emitted(triCount, 0);
+	int bestTri = 0;
+	for(size_t t = 0; t < triCount; t++){
+		triScore[t] = vertScore[indices[3*t]] + vertScore[indices[3*t+1]] + vertScore[indices[3*t+2]];
+		if(triScore[t] > triScore[bestTri]){
+			bestTri = t;
+		}
+	}
+
+	std::vector<unsigned int> out;
+	out.reserve(indices.size());
+	unsigned int cache[VertexCacheSize + 3];
+	unsigned int cacheCount = 0;
+	size_t scanCursor = 0;
+
+	for(size_t n = 0; n < triCount; n++){
+		//nothing in the cache has triangles left, start again from the first unused triangle
+		if(bestTri < 0){
+			while(emitted[scanCursor]){
+				scanCursor++;
+			}
+			bestTri = scanCursor;
+		}
+
+		const unsigned int *tri = &indices[3*bestTri];
+		out.insert(out.end(), tri, tri+3);
+		emitted[bestTri] = 1;
+
+		//take the triangle out of its vertices' remaining lists
+		for(int k = 0; k < 3; k++){
+			unsigned int v = tri[k];
+			unsigned int *list = &vertTris[triOffset[v]];
+			for(unsigned int i = 0; i < remaining[v]; i++){
+				if(list[i] == (unsigned int)bestTri){
+					list[i] = list[remaining[v]-1];
+					remaining[v]--;
+					break;
+				}
+			}
+		}
+
+		//move the triangle's vertices to the front of the LRU cache
+		unsigned int newCache[VertexCacheSize + 3];
+		unsigned int newCount = 0;
+		for(int k = 0; k < 3; k++){
+			bool found = false;
+			for(unsigned int i = 0; i < newCount; i++){
+				found = found || newCache[i] == tri[k];
+			}
+			if(!found){
+				newCache[newCount++] = tri[k];
+			}
+		}
+		for(unsigned int i = 0; i < cacheCount; i++){
+			unsigned int v = cache[i];
+			if(v != tri[0] && v != tri[1] && v != tri[2]){
+				newCache[newCount++] = v;
+			}
+		}
+
+		for(unsigned int i = 0; i < newCount; i++){
+			unsigned int v = newCache[i];
+			cachePos[v] = i < VertexCacheSize ? (int)i : -1;
+			vertScore[v] = scoreTable.score(cachePos[v], remaining[v]);
+		}
+
+		//only triangles touching a vertex whose score changed need rescoring
+		bestTri = -1;
+		float bestScore = -1.0f;
+		for(unsigned int i = 0; i < newCount; i++){
+			unsigned int v = newCache[i];
+			const unsigned int *list = &vertTris[triOffset[v]];
+			for(unsigned int j = 0; j < remaining[v]; j++){
+				unsigned int t = list[j];
+				triScore[t] = vertScore[indices[3*t]] + vertScore[indices[3*t+1]] + vertScore[indices[3*t+2]];
+				if(triScore[t] > bestScore){
+					bestScore = triScore[t];
+					bestTri = t;
+				}
+			}
+		}
+
+		cacheCount = newCount < VertexCacheSize ? newCount : VertexCacheSize;
+		for(unsigned int i = 0; i < cacheCount; i++){
+			cache[i] = newCache[i];
+		}
+	}
+
+	indices.swap(out);
+}
+
+float averageCacheMissRatio(const std::vector<unsigned int> &indices, unsigned int cacheSize)
+{
+	if(indices.size() < 3){
+		return 0.0f;
+	}
+
+	unsigned int maxIndex = 0;
+	for(unsigned int v : indices){
+		maxIndex = v > maxIndex ? v : maxIndex;
+	}
+
+	//a vertex is still cached if fewer than cacheSize misses happened since it was loaded
+	std::vector<long long> loadedAt(maxIndex+1, -(long long)cacheSize);
+	long long misses = 0;
+	for(unsigned int v : indices){
+		if(misses - loadedAt[v] >= cacheSize){
+			loadedAt[v] = misses;
+			misses++;
+		}
+	}
+	return misses / (float)(indices.size()/3);
+}
@@ -0,0 +1,20 @@
+#pragma once
+#ifndef _MESHOPTIMIZER_H_
+#define _MESHOPTIMIZER_H_
+
+#include <vector>
+
+//cache size the optimizer scores for and the FIFO size ACMR is measured with
+static const unsigned int VertexCacheSize = 32;
+
+/*
+* Reorders the triangles of an indexed triangle list so consecutive triangles reuse
+* vertices still in the post transform cache (Tom Forsyth's linear speed optimizer).
+* Indices must be in [0, vertexCount).
+*/
+void optimizeVertexCache(std::vector<unsigned int> &indices, unsigned int vertexCount);
+
+//transformed vertices per triangle for a FIFO cache of cacheSize entries, 0.5 is ideal and 3 is no reuse
+float averageCacheMissRatio(const std::vector<unsigned int> &indices, unsigned int cacheSize);
+
+#endif
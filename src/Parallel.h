@@ -0,0 +1,52 @@
+#pragma once
+#ifndef _PARALLEL_H_
+#define _PARALLEL_H_
+
+#include <thread>
+#include <vector>
+
+//resolves a requested thread count, 0 means use every hardware thread
+inline unsigned int resolveThreadCount(unsigned int requested)
+{
+	if(requested > 0){
+		return requested;
+	}
+	unsigned int hw = std::thread::hardware_concurrency();
+	return hw > 0 ? hw : 1;
+}
+
+/*
+* Splits [0, count) into one contiguous block per thread and calls func(begin, end, threadIndex) on each.
+* Blocks are handed out in order, so block t always covers lower indices than block t+1.
+* Runs on the calling thread when there is only one block.
+*/
+template <typename Func>
+void parallelFor(size_t count, unsigned int threadCount, Func func)
+{
+	size_t threads = resolveThreadCount(threadCount);
+	if(threads > count){
+		threads = count;
+	}
+	if(threads <= 1){
+		func((size_t)0, count, 0u);
+		return;
+	}
+
+	std::vector<std::thread> workers;
+	size_t blockSize = (count + threads - 1) / threads;
+	for(size_t t = 1; t < threads; t++){
+		size_t begin = t*blockSize;
+		if(begin >= count){
+			break;
+		}
+		size_t end = begin + blockSize < count ? begin + blockSize : count;
+		workers.push_back(std::thread(func, begin, end, (unsigned int)t));
+	}
+	func((size_t)0, blockSize < count ? blockSize : count, 0u);
+
+	for(std::thread & worker : workers){
+		worker.join();
+	}
+}
+
+#endif
@@ -105,40 +105,72 @@ void Program::unbind()
 	CHECKED_GL_CALL(glUseProgram(0));
 }
 
-void Program::addAttribute(const std::string &name)
+AttributeHandle Program::addAttribute(const std::string &name)
 {
-	attributes[name] = GLSL::getAttribLocation(pid, name.c_str(), isVerbose());
+	GLint location = GLSL::getAttribLocation(pid, name.c_str(), isVerbose());
+	std::map<std::string, int>::const_iterator attribute = attributes.find(name);
+	if (attribute != attributes.end())
+	{
+		attributeLocations[attribute->second] = location;
+		return findAttribute(name);
+	}
+	attributes[name] = attributeLocations.size();
+	attributeLocations.push_back(location);
+	return findAttribute(name);
 }
 
-void Program::addUniform(const std::string &name)
+UniformHandle Program::addUniform(const std::string &name)
 {
-	uniforms[name] = GLSL::getUniformLocation(pid, name.c_str(), isVerbose());
+	GLint location = GLSL::getUniformLocation(pid, name.c_str(), isVerbose());
+	std::map<std::string, int>::const_iterator uniform = uniforms.find(name);
+	if (uniform != uniforms.end())
+	{
+		uniformLocations[uniform->second] = location;
+		return findUniform(name);
+	}
+	uniforms[name] = uniformLocations.size();
+	uniformLocations.push_back(location);
+	return findUniform(name);
 }
 
-GLint Program::getAttribute(const std::string &name) const
+AttributeHandle Program::findAttribute(const std::string &name) const
 {
-	std::map<std::string, GLint>::const_iterator attribute = attributes.find(name.c_str());
+	AttributeHandle handle;
+	std::map<std::string, int>::const_iterator attribute = attributes.find(name);
 	if (attribute == attributes.end())
 	{
 		if (isVerbose())
 		{
 			std::cout << name << " is not an attribute variable" << std::endl;
 		}
-		return -1;
+		return handle;
 	}
-	return attribute->second;
+	handle.slot = attribute->second;
+	return handle;
 }
 
-GLint Program::getUniform(const std::string &name) const
+UniformHandle Program::findUniform(const std::string &name) const
 {
-	std::map<std::string, GLint>::const_iterator uniform = uniforms.find(name.c_str());
+	UniformHandle handle;
+	std::map<std::string, int>::const_iterator uniform = uniforms.find(name);
 	if (uniform == uniforms.end())
 	{
 		if (isVerbose())
 		{
 			std::cout << name << " is not a uniform variable" << std::endl;
 		}
-		return -1;
+		return handle;
 	}
-	return uniform->second;
+	handle.slot = uniform->second;
+	return handle;
+}
+
+GLint Program::getAttribute(const std::string &name) const
+{
+	return getAttribute(findAttribute(name));
+}
+
+GLint Program::getUniform(const std::string &name) const
+{
+	return getUniform(findUniform(name));
 }
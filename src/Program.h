@@ -6,6 +6,7 @@
 
 #include <map>
 #include <string>
+#include <vector>
 
 #ifdef __EMSCRIPTEN__
 #include <GLES3/gl3.h>
@@ -17,6 +18,18 @@
 
 std::string readFileAsString(const std::string &fileName);
 
+// Index into a program's location table, resolved once from a name with addUniform/findUniform
+// so per draw lookups are an array index instead of a string search
+struct UniformHandle
+{
+	int slot = -1;
+};
+
+struct AttributeHandle
+{
+	int slot = -1;
+};
+
 class Program
 {
 
@@ -30,11 +43,17 @@ public:
 	virtual void bind();
 	virtual void unbind();
 
-	void addAttribute(const std::string &name);
-	void addUniform(const std::string &name);
+	AttributeHandle addAttribute(const std::string &name);
+	UniformHandle addUniform(const std::string &name);
 	GLint getAttribute(const std::string &name) const;
 	GLint getUniform(const std::string &name) const;
 
+	// Handle based lookups for hot paths, an invalid handle gives -1 like an unknown name
+	AttributeHandle findAttribute(const std::string &name) const;
+	UniformHandle findUniform(const std::string &name) const;
+	GLint getAttribute(AttributeHandle handle) const { return handle.slot < 0 ? -1 : attributeLocations[handle.slot]; }
+	GLint getUniform(UniformHandle handle) const { return handle.slot < 0 ? -1 : uniformLocations[handle.slot]; }
+
 	GLuint pid;
 
 protected:
@@ -45,8 +64,11 @@ protected:
 private:
 
 
-	std::map<std::string, GLint> attributes;
-	std::map<std::string, GLint> uniforms;
+	// name to slot in the location tables
+	std::map<std::string, int> attributes;
+	std::map<std::string, int> uniforms;
+	std::vector<GLint> attributeLocations;
+	std::vector<GLint> uniformLocations;
 	bool verbose;
 
 };
@@ -1,7 +1,17 @@
 #include "Shape.h"
 #include <iostream>
 #include <assert.h>
+#include <algorithm>
+#include <cmath>
+#include <cstddef>
 #include "MatrixStack.h"
+#include "Parallel.h"
+#include "MeshOptimizer.h"
+#include "Frustum.h"
+#include "MeshCache.h"
+#include <fstream>
+#include <cstring>
+#include <cstdio>
 
 #include "GLSL.h"
 #include "Program.h"
@@ -14,6 +24,42 @@
 using namespace std;
 using namespace glm;
 
+//texture unit the batched voronoi draws read cell transforms or cell data from
+static const GLint CellBufferUnit = 2;
+//must match MAX_KEY_FRAMES in the vertex shader
+static const int MaxShaderKeyFrames = 16;
+
+//one vertex of the packed layout, normal is 10:10:10:2 snorm and texcoords are 16 bit unorm
+struct PackedVertex
+{
+	float pos[3];
+	GLuint normal;
+	GLushort tex[2];
+	GLuint cell;
+};
+static_assert(sizeof(struct PackedVertex) == 24, "packed vertex must not be padded");
+
+//size of one vertex in the separate float buffers, for comparing against the packed layout
+static const size_t UnpackedVertexSize = 8*sizeof(float);
+
+//packs a normal into GL_INT_2_10_10_10_REV, x in the low bits
+static GLuint packNormal(float x, float y, float z)
+{
+	GLuint packed = 0;
+	float n[3] = {x, y, z};
+	for(int i = 0; i < 3; i++){
+		float c = n[i] < -1.0f ? -1.0f : (n[i] > 1.0f ? 1.0f : n[i]);
+		int q = (int)roundf(c * 511.0f);
+		packed |= ((GLuint)q & 0x3FF) << (10*i);
+	}
+	return packed;
+}
+
+static GLushort packUnorm16(float v)
+{
+	return (GLushort)roundf(v * 65535.0f);
+}
+
 float defaultAnim(float distance)
 {
 	return 5*distance;
@@ -24,6 +70,8 @@ Shape::Shape() :
 	posBufID(0),
 	norBufID(0),
 	texBufID(0), 
+	cellBufID(0),
+	packedBufID(0),
    vaoID(0)
 {
 	min = glm::vec3(0);
@@ -120,83 +168,147 @@ void Shape::resize(float scaleX, float shiftX, float scaleY, float shiftY, float
 	}
 }
 
-/* Generate normals for shape that doesn't have them */
+/*
+* Generate normals for shape that doesn't have them
+* face normals are found in parallel, then each vertex gathers the faces around it from an incidence array
+* every vertex is written by one thread and sums its faces in face order, so no atomics are needed
+* and the normals are the same for any thread count
+*/
 void Shape::generateNormals()
 {
-	//initialize normal buffer to all 0s
-	norBuf.resize(posBuf.size());
-	fill(norBuf.begin(), norBuf.end(), 0);
-
-	//get normal vector for every face and update adjacent vertices
-	for (size_t f = 0; f < eleBuf.size() / 3; f++) {
-		//take cross product to get normal for the face
-		vec3 vert1 = vec3(posBuf[3*eleBuf[3*f]], posBuf[3*eleBuf[3*f] + 1], posBuf[3*eleBuf[3*f] + 2]);
-		vec3 vert2 = vec3(posBuf[3*eleBuf[3*f+1]], posBuf[3*eleBuf[3*f+1] + 1], posBuf[3*eleBuf[3*f+1] + 2]);
-		vec3 vert3 = vec3(posBuf[3*eleBuf[3*f+2]], posBuf[3*eleBuf[3*f+2] + 1], posBuf[3*eleBuf[3*f+2] + 2]);
-		
-
-		vec3 v1 = vert2 - vert1;
-		vec3 v2 = vert3 - vert1;
+	size_t vertCount = posBuf.size()/3;
+	size_t faceCount = eleBuf.size()/3;
+
+	//get normal vector for every face, not normalized so bigger faces count for more
+	std::vector<vec3> faceNormals(faceCount);
+	parallelFor(faceCount, threadCount, [this, &faceNormals](size_t begin, size_t end, unsigned int thread){
+		for(size_t f = begin; f < end; f++){
+			vec3 vert1 = vec3(posBuf[3*eleBuf[3*f]], posBuf[3*eleBuf[3*f] + 1], posBuf[3*eleBuf[3*f] + 2]);
+			vec3 vert2 = vec3(posBuf[3*eleBuf[3*f+1]], posBuf[3*eleBuf[3*f+1] + 1], posBuf[3*eleBuf[3*f+1] + 2]);
+			vec3 vert3 = vec3(posBuf[3*eleBuf[3*f+2]], posBuf[3*eleBuf[3*f+2] + 1], posBuf[3*eleBuf[3*f+2] + 2]);
+			faceNormals[f] = cross(vert2 - vert1, vert3 - vert1);
+		}
+	});
 
-		vec3 normal = cross(v1, v2);
+	//faces using vertex v are incidentFaces[incidentOffsets[v]] up to incidentOffsets[v+1], in increasing order
+	std::vector<unsigned int> incidentOffsets(vertCount + 1, 0);
+	for(size_t i = 0; i < eleBuf.size(); i++){
+		incidentOffsets[eleBuf[i] + 1]++;
+	}
+	for(size_t v = 0; v < vertCount; v++){
+		incidentOffsets[v+1] += incidentOffsets[v];
+	}
+	std::vector<unsigned int> incidentFaces(eleBuf.size());
+	std::vector<unsigned int> fill(incidentOffsets.begin(), incidentOffsets.end() - 1);
+	for(size_t i = 0; i < eleBuf.size(); i++){
+		incidentFaces[fill[eleBuf[i]]++] = i/3;
+	}
 
-		//add normal for the face to each of it's vertices
-		norBuf[3*eleBuf[3*f]] += normal.x;
-		norBuf[3*eleBuf[3*f]+1] += normal.y;
-		norBuf[3*eleBuf[3*f]+2] += normal.z;
+	//sum the faces around every vertex and normalize
+	norBuf.resize(posBuf.size());
+	parallelFor(vertCount, threadCount, [&](size_t begin, size_t end, unsigned int thread){
+		for(size_t v = begin; v < end; v++){
+			vec3 normal(0.0f);
+			for(unsigned int k = incidentOffsets[v]; k < incidentOffsets[v+1]; k++){
+				normal += faceNormals[incidentFaces[k]];
+			}
+			float len = sqrt(normal.x*normal.x + normal.y*normal.y + normal.z*normal.z);
+			norBuf[3*v] = normal.x / len;
+			norBuf[3*v+1] = normal.y / len;
+			norBuf[3*v+2] = normal.z / len;
+		}
+	});
+}
 
-		norBuf[3*eleBuf[3*f+1]] += normal.x;
-		norBuf[3*eleBuf[3*f+1]+1] += normal.y;
-		norBuf[3*eleBuf[3*f+1]+2] += normal.z;
+/* Initialize openGL buffers, then free whatever the residency policy does not keep */
+void Shape::init()
+{
+	upload();
+	applyResidency();
+}
 
-		norBuf[3*eleBuf[3*f+2]] += normal.x;
-		norBuf[3*eleBuf[3*f+2]+1] += normal.y;
-		norBuf[3*eleBuf[3*f+2]+2] += normal.z;
+/* the arrays upload() sends, from a mapped mesh cache if one was loaded, else from the buffers */
+struct MeshStreams Shape::meshStreams() const
+{
+	if(meshCache){
+		return cachedStreams;
 	}
 
-	//normalize all vectors
-	for (size_t v = 0; v < norBuf.size() / 3; v++){
-		float len = sqrt(norBuf[3*v]*norBuf[3*v] + norBuf[3*v+1]*norBuf[3*v+1] + norBuf[3*v+2]*norBuf[3*v+2]);
-		norBuf[3*v] /= len;
-		norBuf[3*v+1] /= len;
-		norBuf[3*v+2] /= len;
-	}
+	struct MeshStreams streams;
+	streams.vertexCount = posBuf.size()/3;
+	streams.pos = posBuf.data();
+	streams.nor = norBuf.data();
+	streams.tex = texBuf.empty() ? NULL : texBuf.data();
+	streams.cell = usingVoronoi ? cellBuf.data() : NULL;
+	streams.indexCount = eleBuf.size();
+	streams.ele = shortCellIndices ? NULL : eleBuf.data();
+	streams.shortEle = shortCellIndices ? cellEleBuf.data() : NULL;
+	return streams;
 }
 
-/* Initialize openGL buffers */
-void Shape::init()
+/* sends the mesh to the GPU, then closes the mesh cache if it came from one */
+void Shape::upload()
 {
    // Initialize the vertex array object
    glGenVertexArrays(1, &vaoID);
    glBindVertexArray(vaoID);
 
-	// Send the position array to the GPU
-	glGenBuffers(1, &posBufID);
-	glBindBuffer(GL_ARRAY_BUFFER, posBufID);
-	glBufferData(GL_ARRAY_BUFFER, posBuf.size()*sizeof(float), &posBuf[0], GL_STATIC_DRAW);
-	
-	// Send the normal array to the GPU
-	if(norBuf.empty()) {
+	if(norBuf.empty() && !meshCache) {
 		generateNormals();
 		cout << "Generated normals" << endl;
 	}
-	glGenBuffers(1, &norBufID);
-	glBindBuffer(GL_ARRAY_BUFFER, norBufID);
-	glBufferData(GL_ARRAY_BUFFER, norBuf.size()*sizeof(float), &norBuf[0], GL_STATIC_DRAW);
-	
-	// Send the texture array to the GPU
-	if(texBuf.empty()) {
-		texBufID = 0;
-	} else {
-		glGenBuffers(1, &texBufID);
-		glBindBuffer(GL_ARRAY_BUFFER, texBufID);
-		glBufferData(GL_ARRAY_BUFFER, texBuf.size()*sizeof(float), &texBuf[0], GL_STATIC_DRAW);
+
+	struct MeshStreams streams = meshStreams();
+	if(packedVertices && !canPackVertices(streams)) {
+		cerr << "texture coordinates outside [0,1], using unpacked vertex buffers" << endl;
+		packedVertices = false;
+	}
+
+	// Send the vertex attributes to the GPU, in one interleaved buffer when packed
+	createVertexBuffers(streams.vertexCount, streams.tex != NULL);
+	uploadVertices(0, streams);
+	if(packedVertices) {
+		//compare against what the separate float buffers would have used
+		size_t vertCount = streams.vertexCount;
+		size_t unpackedSize = vertCount*(3 + 3 + (streams.tex == NULL ? 0 : 2))*sizeof(float);
+		if(usingVoronoi){
+			unpackedSize += vertCount*sizeof(unsigned int);
+		}
+		size_t packedSize = vertCount*sizeof(struct PackedVertex);
+		cout << "Packed " << vertCount << " vertices: " << packedSize / 1024 << " KB instead of "
+			<< unpackedSize / 1024 << " KB (saved " << (unpackedSize - packedSize) / 1024 << " KB, "
+			<< sizeof(struct PackedVertex) << " bytes per vertex instead of "
+			<< UnpackedVertexSize + (usingVoronoi ? sizeof(unsigned int) : 0) << ")" << endl;
 	}
 	
-	// Send the element array to the GPU
+	// Send a buffer for the cell transforms to the GPU
+	if(usingVoronoi) {
+		glGenBuffers(1, &cellTransformBufID);
+		glBindBuffer(GL_TEXTURE_BUFFER, cellTransformBufID);
+		glBufferData(GL_TEXTURE_BUFFER, voronoiPieces.size()*sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+		glGenTextures(1, &cellTransformTexID);
+		glBindTexture(GL_TEXTURE_BUFFER, cellTransformTexID);
+		glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, cellTransformBufID);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+		uploadCellData();
+
+		visibleCells.reserve(voronoiPieces.size());
+		visibleCounts.reserve(voronoiPieces.size());
+		visibleOffsets.reserve(voronoiPieces.size());
+		visibleBaseVertices.reserve(voronoiPieces.size());
+	}
+
+	// Send the element array to the GPU, voronoi cells use 16 bit indices when they fit
+	elementCount = streams.indexCount;
 	glGenBuffers(1, &eleBufID);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
-	glBufferData(GL_ELEMENT_ARRAY_BUFFER, eleBuf.size()*sizeof(unsigned int), &eleBuf[0], GL_STATIC_DRAW);
+	if(shortCellIndices) {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, streams.indexCount*sizeof(unsigned short), streams.shortEle, GL_STATIC_DRAW);
+	} else {
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, streams.indexCount*sizeof(unsigned int), streams.ele, GL_STATIC_DRAW);
+	}
 	
 	// Unbind the arrays
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
@@ -204,55 +316,206 @@ void Shape::init()
 	
 	int err = glGetError();
 	assert(err == GL_NO_ERROR);
+
+	//everything in the mapping is on the GPU now
+	meshCache.reset();
 }
 
+/* frees the CPU copies the residency policy does not keep and reports how much memory that saved */
+void Shape::applyResidency()
+{
+	if(residency == MESH_KEEP_ALL){
+		return;
+	}
 
-/* draw the shape */
-void Shape::draw(const shared_ptr<Program> prog) const
+	size_t before = cpuMeshBytes();
+	releaseCpuMesh();
+	size_t after = cpuMeshBytes();
+	cout << "CPU mesh data: " << before / 1024 << " KB before upload, " << after / 1024 << " KB kept after ("
+		<< (residency == MESH_DROP_ALL ? "drop all" : "keep queries") << ")" << endl;
+}
+
+/* bytes held by the CPU side buffers */
+size_t Shape::cpuMeshBytes() const
 {
-	int h_pos, h_nor, h_tex;
-	h_pos = h_nor = h_tex = -1;
+	size_t bytes = bufferBytes(posBuf) + bufferBytes(norBuf) + bufferBytes(texBuf) + bufferBytes(eleBuf) + bufferBytes(cellBuf);
+	bytes += bufferBytes(cellEleBuf) + bufferBytes(vertexToContainer) + bufferBytes(vertexSeedDistances);
+	bytes += bufferBytes(adjacencyOffsets) + bufferBytes(adjacencyCells);
+	bytes += bufferBytes(voronoiPieces) + bufferBytes(cellIndexCounts) + bufferBytes(cellIndexOffsets) + bufferBytes(cellBaseVertices);
+	bytes += bufferBytes(visibleCells) + bufferBytes(visibleCounts) + bufferBytes(visibleOffsets) + bufferBytes(visibleBaseVertices);
+	return bytes;
+}
 
-	// if option to generate voronoi shapes has been set, then use that draw function instead
-	if(usingVoronoi){
-		return drawVoronoi(prog);
+/*
+* frees the buffers only the upload needed, the cells' draw ranges and bounds stay since every draw reads them
+* cell neighbours are a query so they are only freed by MESH_DROP_ALL
+*/
+void Shape::releaseCpuMesh()
+{
+	releaseBuffer(posBuf);
+	releaseBuffer(norBuf);
+	releaseBuffer(texBuf);
+	releaseBuffer(eleBuf);
+	releaseBuffer(cellBuf);
+	releaseBuffer(cellEleBuf);
+	releaseBuffer(vertexToContainer);
+	releaseBuffer(vertexSeedDistances);
+	if(residency == MESH_DROP_ALL){
+		releaseBuffer(adjacencyOffsets);
+		releaseBuffer(adjacencyCells);
+	}
+}
+
+
+/* the packed layout stores texcoords as unorm so they have to be in [0,1] */
+bool Shape::canPackVertices(const struct MeshStreams &streams) const
+{
+	if(streams.tex == NULL){
+		return true;
+	}
+	for(size_t i = 0; i < 2*streams.vertexCount; i++){
+		if(streams.tex[i] < 0.0f || streams.tex[i] > 1.0f){
+			return false;
+		}
+	}
+	return true;
+}
+
+/* makes room on the GPU for vertexCount vertices, interleaved in packedBufID or in separate float buffers */
+void Shape::createVertexBuffers(size_t vertexCount, bool texCoords)
+{
+	hasTexCoords = texCoords;
+	if(packedVertices) {
+		glGenBuffers(1, &packedBufID);
+		glBindBuffer(GL_ARRAY_BUFFER, packedBufID);
+		glBufferData(GL_ARRAY_BUFFER, vertexCount*sizeof(struct PackedVertex), NULL, GL_STATIC_DRAW);
+		return;
+	}
+
+	glGenBuffers(1, &posBufID);
+	glBindBuffer(GL_ARRAY_BUFFER, posBufID);
+	glBufferData(GL_ARRAY_BUFFER, 3*vertexCount*sizeof(float), NULL, GL_STATIC_DRAW);
+
+	glGenBuffers(1, &norBufID);
+	glBindBuffer(GL_ARRAY_BUFFER, norBufID);
+	glBufferData(GL_ARRAY_BUFFER, 3*vertexCount*sizeof(float), NULL, GL_STATIC_DRAW);
+
+	if(!texCoords) {
+		texBufID = 0;
+	} else {
+		glGenBuffers(1, &texBufID);
+		glBindBuffer(GL_ARRAY_BUFFER, texBufID);
+		glBufferData(GL_ARRAY_BUFFER, 2*vertexCount*sizeof(float), NULL, GL_STATIC_DRAW);
+	}
+
+	if(usingVoronoi) {
+		glGenBuffers(1, &cellBufID);
+		glBindBuffer(GL_ARRAY_BUFFER, cellBufID);
+		glBufferData(GL_ARRAY_BUFFER, vertexCount*sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+	}
+}
+
+/* 
+* writes streams' vertices to the buffers createVertexBuffers made, starting at vertex first
+* vertices added by the voronoi split are already in the streams at this point
+*/
+void Shape::uploadVertices(size_t first, const struct MeshStreams &streams)
+{
+	size_t vertCount = streams.vertexCount;
+	if(vertCount == 0) {
+		return;
+	}
+	if(packedVertices) {
+		std::vector<struct PackedVertex> packed(vertCount);
+		for(size_t v = 0; v < vertCount; v++){
+			struct PackedVertex &out = packed[v];
+			out.pos[0] = streams.pos[3*v];
+			out.pos[1] = streams.pos[3*v+1];
+			out.pos[2] = streams.pos[3*v+2];
+			out.normal = packNormal(streams.nor[3*v], streams.nor[3*v+1], streams.nor[3*v+2]);
+			out.tex[0] = streams.tex == NULL ? 0 : packUnorm16(streams.tex[2*v]);
+			out.tex[1] = streams.tex == NULL ? 0 : packUnorm16(streams.tex[2*v+1]);
+			out.cell = streams.cell == NULL ? 0 : streams.cell[v];
+		}
+		glBindBuffer(GL_ARRAY_BUFFER, packedBufID);
+		glBufferSubData(GL_ARRAY_BUFFER, first*sizeof(struct PackedVertex), vertCount*sizeof(struct PackedVertex), &packed[0]);
+		return;
+	}
+
+	glBindBuffer(GL_ARRAY_BUFFER, posBufID);
+	glBufferSubData(GL_ARRAY_BUFFER, 3*first*sizeof(float), 3*vertCount*sizeof(float), streams.pos);
+	glBindBuffer(GL_ARRAY_BUFFER, norBufID);
+	glBufferSubData(GL_ARRAY_BUFFER, 3*first*sizeof(float), 3*vertCount*sizeof(float), streams.nor);
+	if(texBufID != 0 && streams.tex != NULL) {
+		glBindBuffer(GL_ARRAY_BUFFER, texBufID);
+		glBufferSubData(GL_ARRAY_BUFFER, 2*first*sizeof(float), 2*vertCount*sizeof(float), streams.tex);
+	}
+	if(cellBufID != 0 && streams.cell != NULL) {
+		glBindBuffer(GL_ARRAY_BUFFER, cellBufID);
+		glBufferSubData(GL_ARRAY_BUFFER, first*sizeof(unsigned int), vertCount*sizeof(unsigned int), streams.cell);
+	}
+}
+
+/* enables the vertex attributes for whichever vertex layout was uploaded, returned locations are -1 if unused */
+void Shape::bindVertexAttributes(const Program &prog, const struct ShapeDrawHandles &h, int &h_pos, int &h_nor, int &h_tex, int &h_cell) const
+{
+	h_pos = prog.getAttribute(h.vertPos);
+	h_nor = prog.getAttribute(h.vertNor);
+	h_tex = hasTexCoords ? prog.getAttribute(h.vertTex) : -1;
+	h_cell = usingVoronoi ? prog.getAttribute(h.vertCell) : -1;
+
+	if(packedVertices) {
+		GLsizei stride = sizeof(struct PackedVertex);
+		glBindBuffer(GL_ARRAY_BUFFER, packedBufID);
+		GLSL::enableVertexAttribArray(h_pos);
+		glVertexAttribPointer(h_pos, 3, GL_FLOAT, GL_FALSE, stride, (const void *)offsetof(struct PackedVertex, pos));
+		if(h_nor != -1) {
+			GLSL::enableVertexAttribArray(h_nor);
+			glVertexAttribPointer(h_nor, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (const void *)offsetof(struct PackedVertex, normal));
+		}
+		if(h_tex != -1) {
+			GLSL::enableVertexAttribArray(h_tex);
+			glVertexAttribPointer(h_tex, 2, GL_UNSIGNED_SHORT, GL_TRUE, stride, (const void *)offsetof(struct PackedVertex, tex));
+		}
+		if(h_cell != -1) {
+			GLSL::enableVertexAttribArray(h_cell);
+			glVertexAttribIPointer(h_cell, 1, GL_UNSIGNED_INT, stride, (const void *)offsetof(struct PackedVertex, cell));
+		}
+		return;
 	}
 
-   glBindVertexArray(vaoID);
 	// Bind position buffer
-	h_pos = prog->getAttribute("vertPos");
 	GLSL::enableVertexAttribArray(h_pos);
 	glBindBuffer(GL_ARRAY_BUFFER, posBufID);
 	glVertexAttribPointer(h_pos, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
 	
 	// Bind normal buffer
-	h_nor = prog->getAttribute("vertNor");
 	if(h_nor != -1 && norBufID != 0) {
 		GLSL::enableVertexAttribArray(h_nor);
 		glBindBuffer(GL_ARRAY_BUFFER, norBufID);
 		glVertexAttribPointer(h_nor, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
 	}
 
-	if (texBufID != 0) {	
-		// Bind texcoords buffer
-		h_tex = prog->getAttribute("vertTex");
-		if(h_tex != -1 && texBufID != 0) {
-			GLSL::enableVertexAttribArray(h_tex);
-			glBindBuffer(GL_ARRAY_BUFFER, texBufID);
-			glVertexAttribPointer(h_tex, 2, GL_FLOAT, GL_FALSE, 0, (const void *)0);
-		}
+	// Bind texcoords buffer
+	if(h_tex != -1 && texBufID != 0) {
+		GLSL::enableVertexAttribArray(h_tex);
+		glBindBuffer(GL_ARRAY_BUFFER, texBufID);
+		glVertexAttribPointer(h_tex, 2, GL_FLOAT, GL_FALSE, 0, (const void *)0);
 	}
 	
-	// Bind element buffer
-	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
-	
-	// Draw
-	auto S = std::make_shared<MatrixStack>();
-	S->loadIdentity();
-	glUniformMatrix4fv(prog->getUniform("S"), 1, GL_FALSE, glm::value_ptr(S->topMatrix()));	
-	glDrawElements(GL_TRIANGLES, (int)eleBuf.size(), GL_UNSIGNED_INT, (const void *)0);
-	
-	// Disable and unbind
+	// Bind cell index buffer
+	if(h_cell != -1 && cellBufID != 0) {
+		GLSL::enableVertexAttribArray(h_cell);
+		glBindBuffer(GL_ARRAY_BUFFER, cellBufID);
+		glVertexAttribIPointer(h_cell, 1, GL_UNSIGNED_INT, 0, (const void *)0);
+	}
+}
+
+void Shape::unbindVertexAttributes(int h_pos, int h_nor, int h_tex, int h_cell) const
+{
+	if(h_cell != -1) {
+		GLSL::disableVertexAttribArray(h_cell);
+	}
 	if(h_tex != -1) {
 		GLSL::disableVertexAttribArray(h_tex);
 	}
@@ -261,10 +524,297 @@ void Shape::draw(const shared_ptr<Program> prog) const
 	}
 	GLSL::disableVertexAttribArray(h_pos);
 	glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+/* looks up the program locations used for drawing, only when the program changes */
+const struct ShapeDrawHandles &Shape::drawHandles(const Program &prog) const
+{
+	if(handles.program != &prog){
+		handles.program = &prog;
+		handles.vertPos = prog.findAttribute("vertPos");
+		handles.vertNor = prog.findAttribute("vertNor");
+		handles.vertTex = prog.findAttribute("vertTex");
+		handles.S = prog.findUniform("S");
+		if(usingVoronoi){
+			handles.vertCell = prog.findAttribute("vertCell");
+			handles.cellMode = prog.findUniform("cellMode");
+			handles.cellTransforms = prog.findUniform("cellTransforms");
+			handles.cellData = prog.findUniform("cellData");
+			handles.animTime = prog.findUniform("animTime");
+			handles.keyFrames = prog.findUniform("keyFrames");
+			handles.keyFrameCount = prog.findUniform("keyFrameCount");
+		}
+	}
+	return handles;
+}
+
+/* draw the shape */
+void Shape::draw(const shared_ptr<Program> prog) const
+{
+	int h_pos, h_nor, h_tex, h_cell;
+
+	// if option to generate voronoi shapes has been set, then use that draw function instead
+	if(usingVoronoi){
+		return drawVoronoi(prog);
+	}
+
+	const struct ShapeDrawHandles &h = drawHandles(*prog);
+
+   glBindVertexArray(vaoID);
+	bindVertexAttributes(*prog, h, h_pos, h_nor, h_tex, h_cell);
+	
+	// Bind element buffer
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
+	
+	// Draw
+	glm::mat4 S(1.0f);
+	glUniformMatrix4fv(prog->getUniform(h.S), 1, GL_FALSE, glm::value_ptr(S));	
+	glDrawElements(GL_TRIANGLES, (int)elementCount, GL_UNSIGNED_INT, (const void *)0);
+	drawCallCount = 1;
+	
+	// Disable and unbind
+	unbindVertexAttributes(h_pos, h_nor, h_tex, h_cell);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
 
 
+/*
+* reorders the vertices so each cell's vertices are contiguous, in the order the cell's faces first use them
+* vertices no face uses are moved to the end
+*/
+void Shape::groupCellVertices()
+{
+	const unsigned int NOT_PLACED = 0xFFFFFFFF;
+	size_t vertCount = posBuf.size()/3;
+	std::vector<unsigned int> newIndex(vertCount, NOT_PLACED);
+	std::vector<unsigned int> order;
+	order.reserve(vertCount);
+
+	for(struct VoronoiContainer & piece : voronoiPieces){
+		piece.baseVertex = order.size();
+		for(unsigned int i = piece.indexOffset; i < piece.indexOffset + piece.indexCount; i++){
+			unsigned int v = eleBuf[i];
+			if(newIndex[v] == NOT_PLACED){
+				newIndex[v] = order.size();
+				order.push_back(v);
+			}
+		}
+		piece.vertexCount = order.size() - piece.baseVertex;
+	}
+	for(size_t v = 0; v < vertCount; v++){
+		if(newIndex[v] == NOT_PLACED){
+			newIndex[v] = order.size();
+			order.push_back(v);
+		}
+	}
+
+	remapVertices(order);
+	for(unsigned int & v : eleBuf){
+		v = newIndex[v];
+	}
+}
+
+/* moves vertex order[i] to position i in every per vertex buffer */
+void Shape::remapVertices(const std::vector<unsigned int> &order)
+{
+	size_t vertCount = order.size();
+	std::vector<float> newPos(posBuf.size());
+	std::vector<float> newNor(norBuf.size());
+	std::vector<float> newTex(texBuf.size());
+	std::vector<unsigned int> newCell(cellBuf.size());
+	for(size_t i = 0; i < vertCount; i++){
+		unsigned int v = order[i];
+		for(int j = 0; j < 3; j++){
+			newPos[3*i+j] = posBuf[3*v+j];
+			newNor[3*i+j] = norBuf[3*v+j];
+		}
+		if(!texBuf.empty()){
+			newTex[2*i] = texBuf[2*v];
+			newTex[2*i+1] = texBuf[2*v+1];
+		}
+		if(!cellBuf.empty()){
+			newCell[i] = cellBuf[v];
+		}
+	}
+	posBuf.swap(newPos);
+	norBuf.swap(newNor);
+	texBuf.swap(newTex);
+	cellBuf.swap(newCell);
+}
+
+/*
+* reorders triangles for the post transform vertex cache, then vertices into the order the triangles use them
+* voronoi cells are optimized one at a time so each cell's vertices stay contiguous
+* call after generateVoronoi and before init
+*/
+void Shape::optimizeMesh()
+{
+	float before = averageCacheMissRatio(eleBuf, VertexCacheSize);
+
+	if(usingVoronoi){
+		parallelFor(voronoiPieces.size(), threadCount, [this](size_t begin, size_t end, unsigned int thread){
+			std::vector<unsigned int> local;
+			for(size_t i = begin; i < end; i++){
+				struct VoronoiContainer &piece = voronoiPieces[i];
+				unsigned int *indices = &eleBuf[piece.indexOffset];
+				local.resize(piece.indexCount);
+				for(size_t k = 0; k < local.size(); k++){
+					local[k] = indices[k] - piece.baseVertex;
+				}
+				optimizeVertexCache(local, piece.vertexCount);
+				for(size_t k = 0; k < local.size(); k++){
+					indices[k] = local[k] + piece.baseVertex;
+				}
+			}
+		});
+
+		//regrouping puts each cell's vertices in the order its new triangle order first uses them
+		groupCellVertices();
+		buildCellIndices();
+	}
+	else{
+		size_t vertCount = posBuf.size()/3;
+		optimizeVertexCache(eleBuf, vertCount);
+
+		const unsigned int NOT_PLACED = 0xFFFFFFFF;
+		std::vector<unsigned int> newIndex(vertCount, NOT_PLACED);
+		std::vector<unsigned int> order;
+		order.reserve(vertCount);
+		for(unsigned int v : eleBuf){
+			if(newIndex[v] == NOT_PLACED){
+				newIndex[v] = order.size();
+				order.push_back(v);
+			}
+		}
+		for(size_t v = 0; v < vertCount; v++){
+			if(newIndex[v] == NOT_PLACED){
+				newIndex[v] = order.size();
+				order.push_back(v);
+			}
+		}
+		remapVertices(order);
+		for(unsigned int & v : eleBuf){
+			v = newIndex[v];
+		}
+	}
+
+	float after = averageCacheMissRatio(eleBuf, VertexCacheSize);
+	cout << "Vertex cache ACMR (" << VertexCacheSize << " entry FIFO): " << before << " before, " << after << " after optimizing" << endl;
+}
+
+/*
+* builds 16 bit indices relative to each cell's base vertex and the per cell draw ranges
+* if any cell has more vertices than 16 bits can address the cells are drawn from the 32 bit eleBuf instead
+*/
+void Shape::buildCellIndices()
+{
+	bool fits = true;
+	for(const struct VoronoiContainer & piece : voronoiPieces){
+		if(piece.vertexCount > 0x10000){
+			fits = false;
+		}
+	}
+
+	cellEleBuf.clear();
+	if(fits){
+		cellEleBuf.reserve(eleBuf.size());
+		for(const struct VoronoiContainer & piece : voronoiPieces){
+			for(unsigned int k = piece.indexOffset; k < piece.indexOffset + piece.indexCount; k++){
+				cellEleBuf.push_back(eleBuf[k] - piece.baseVertex);
+			}
+		}
+	}
+	shortCellIndices = fits;
+	if(!fits){
+		cerr << "voronoi cell has more than 65536 vertices, using 32 bit indices" << endl;
+	}
+	buildCellDrawRanges();
+}
+
+/* each cell's count, offset and base vertex in whichever element buffer is uploaded */
+void Shape::buildCellDrawRanges()
+{
+	cellIndexCounts.resize(voronoiPieces.size());
+	cellIndexOffsets.resize(voronoiPieces.size());
+	cellBaseVertices.resize(voronoiPieces.size());
+	for(unsigned int i = 0; i < voronoiPieces.size(); i++){
+		const struct VoronoiContainer &piece = voronoiPieces[i];
+		cellIndexCounts[i] = piece.indexCount;
+		if(shortCellIndices){
+			cellIndexOffsets[i] = (const void *)(sizeof(unsigned short) * piece.indexOffset);
+			cellBaseVertices[i] = piece.baseVertex;
+		}
+		else{
+			cellIndexOffsets[i] = (const void *)(sizeof(unsigned int) * piece.indexOffset);
+			cellBaseVertices[i] = 0;
+		}
+	}
+}
+
+/* draws one voronoi cell from the bound element buffer */
+void Shape::drawCell(unsigned int cell) const
+{
+	if(shortCellIndices){
+		glDrawElementsBaseVertex(GL_TRIANGLES, cellIndexCounts[cell], GL_UNSIGNED_SHORT, cellIndexOffsets[cell], cellBaseVertices[cell]);
+	}
+	else{
+		glDrawElements(GL_TRIANGLES, cellIndexCounts[cell], GL_UNSIGNED_INT, cellIndexOffsets[cell]);
+	}
+}
+
+/*
+* each cell rotates around its seed, so a sphere there reaching its furthest vertex holds the cell at every point of the animation
+* cells are contiguous by now so each one's vertices are a single range
+*/
+void Shape::computeCellBounds()
+{
+	for(struct VoronoiContainer & piece : voronoiPieces){
+		float radius2 = 0;
+		for(unsigned int v = piece.baseVertex; v < piece.baseVertex + piece.vertexCount; v++){
+			glm::vec3 d = glm::vec3(posBuf[3*v], posBuf[3*v+1], posBuf[3*v+2]) - piece.position;
+			radius2 = std::max(radius2, glm::dot(d, d));
+		}
+		piece.boundRadius = sqrtf(radius2);
+	}
+}
+
+/* fills visibleCells with the cells inside the cull matrix's frustum, all of them until one is set */
+void Shape::cullCells() const
+{
+	visibleCells.clear();
+	if(!cullingEnabled){
+		for(unsigned int i = 0; i < voronoiPieces.size(); i++){
+			visibleCells.push_back(i);
+		}
+		return;
+	}
+
+	struct Frustum frustum;
+	frustum.extract(cullMatrix);
+	for(unsigned int i = 0; i < voronoiPieces.size(); i++){
+		if(frustum.intersectsSphere(voronoiPieces[i].position, voronoiPieces[i].boundRadius)){
+			visibleCells.push_back(i);
+		}
+	}
+}
+
+/* draws every visible voronoi cell with one call, each cell's indices are relative to its own base vertex */
+void Shape::drawVisibleCells() const
+{
+	visibleCounts.clear();
+	visibleOffsets.clear();
+	visibleBaseVertices.clear();
+	for(unsigned int cell : visibleCells){
+		visibleCounts.push_back(cellIndexCounts[cell]);
+		visibleOffsets.push_back(cellIndexOffsets[cell]);
+		visibleBaseVertices.push_back(cellBaseVertices[cell]);
+	}
+	if(!visibleCounts.empty()){
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, &visibleCounts[0], shortCellIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT,
+			&visibleOffsets[0], visibleCounts.size(), &visibleBaseVertices[0]);
+	}
+}
+
 /* 
 * Sets up the animation keyframes for this shape 
 * Does a rotation 90 deg and back over the span of 20 seconds 
@@ -279,6 +829,14 @@ void Shape::createRotateAnimation()
 	rotateAnim->addKeyFrame(20, 0);
 }
 
+/* 
+* sets how many threads generateVoronoi uses, 0 means one per hardware thread
+*/
+void Shape::setThreadCount(unsigned int count)
+{
+	threadCount = count;
+}
+
 /* 
 * sets the function that controls how the animation behaves
 */
@@ -296,7 +854,7 @@ inline float distance(float x1, float y1, float z1, float x2, float y2, float z2
 
 //returns the percentage between the two points that the new point should be (0 closest to p1, 1.0 closest to p2)
 //new point will be equal distance from the two voronoi centers
-float newPointLerp(struct VoronoiContainer *center1, struct VoronoiContainer *center2, glm::vec3 & p1, glm::vec3 & p2)
+float newPointLerp(const struct VoronoiContainer *center1, const struct VoronoiContainer *center2, glm::vec3 & p1, glm::vec3 & p2)
 {
 	glm::vec3 newPt;
 
@@ -310,40 +868,159 @@ float newPointLerp(struct VoronoiContainer *center1, struct VoronoiContainer *ce
 	return t;
 }
 
-//find the closest voronoi container for a given x,y,z position
-struct VoronoiContainer *closestContainer(std::vector<struct VoronoiContainer> & containers, float x, float y, float z)
+//find the index of the closest voronoi container for a given x,y,z position
+//also fills in the distances to it and the second closest container
+unsigned int Shape::closestContainer(float x, float y, float z, struct SeedDistances &dist)
 {
-	float closestDist;
-	struct VoronoiContainer *closest = NULL;
-	if(containers.size() == 0){
+	int closest;
+	seedTree.nearestTwo(x, y, z, closest, dist.nearestDist, dist.second, dist.secondDist);
+	if(closest < 0){
 		//error
 		std::cerr << "error containers empty" << std::endl;
-		return NULL;
+		return 0;
+	}
+
+	return closest;
+}
+
+/*
+* accessors for vertices during the split pass
+* indices at or past out.firstVertex refer to vertices created by this buffer's thread
+*/
+glm::vec3 Shape::splitPosition(const struct FaceSplitBuffer &out, int v) const
+{
+	if(v < (int)out.firstVertex){
+		return glm::vec3(posBuf[3*v], posBuf[3*v+1], posBuf[3*v+2]);
+	}
+	int local = v - out.firstVertex;
+	return glm::vec3(out.posBuf[3*local], out.posBuf[3*local+1], out.posBuf[3*local+2]);
+}
+
+float Shape::splitTexCoord(const struct FaceSplitBuffer &out, int v, int component) const
+{
+	if(v < (int)out.firstVertex){
+		return texBuf[2*v+component];
+	}
+	return out.texBuf[2*(v - out.firstVertex)+component];
+}
+
+glm::vec3 Shape::splitNormal(const struct FaceSplitBuffer &out, int v) const
+{
+	if(v < (int)out.firstVertex){
+		return glm::vec3(norBuf[3*v], norBuf[3*v+1], norBuf[3*v+2]);
+	}
+	int local = v - out.firstVertex;
+	return glm::vec3(out.norBuf[3*local], out.norBuf[3*local+1], out.norBuf[3*local+2]);
+}
+
+const struct VoronoiContainer *Shape::splitContainer(const struct FaceSplitBuffer &out, int v) const
+{
+	if(v < (int)out.firstVertex){
+		return &voronoiPieces[vertexToContainer[v]];
 	}
-	closestDist = distance(x, y, z, containers[0].position.x, containers[0].position.y, containers[0].position.z);
-	closest = &containers[0];
+	return &voronoiPieces[out.vertexToContainer[v - out.firstVertex]];
+}
+
+const struct SeedDistances &Shape::splitSeedDistances(const struct FaceSplitBuffer &out, int v) const
+{
+	if(v < (int)out.firstVertex){
+		return vertexSeedDistances[v];
+	}
+	return out.seedDistances[v - out.firstVertex];
+}
+
+/*
+* returns the vertex where the edge va-vb crosses the border between c1 and c2, creating it if needed
+* the point is always computed from the lower index vertex so every triangle sharing the edge gets the same one
+* returned index is the one it will be referenced by until merged
+*/
+int Shape::edgeSplitVertex(struct FaceSplitBuffer &out, const struct VoronoiContainer *c1, const struct VoronoiContainer *c2, int va, int vb)
+{
+	if(vb < va){
+		std::swap(va, vb);
+	}
+	unsigned int ci1 = c1 - &voronoiPieces[0];
+	unsigned int ci2 = c2 - &voronoiPieces[0];
+	if(ci2 < ci1){
+		std::swap(ci1, ci2);
+		std::swap(c1, c2);
+	}
+
+	struct EdgeSplitKey key;
+	key.vLo = va;
+	key.vHi = vb;
+	key.cLo = ci1;
+	key.cHi = ci2;
+	std::unordered_map<struct EdgeSplitKey, int, EdgeSplitKeyHash>::iterator cached = out.edgeCache.find(key);
+	if(cached != out.edgeCache.end()){
+		return cached->second;
+	}
+
+	glm::vec3 pa = splitPosition(out, va);
+	glm::vec3 pb = splitPosition(out, vb);
+	float lerp = newPointLerp(c1, c2, pa, pb);
+	glm::vec3 newP = pa*(1-lerp) + pb*lerp;
+	out.posBuf.push_back(newP.x);
+	out.posBuf.push_back(newP.y);
+	out.posBuf.push_back(newP.z);
 
-	for(unsigned int i = 1; i < containers.size(); i++){
-		float d = distance(x, y, z, containers[i].position.x, containers[i].position.y, containers[i].position.z);
-		if(d < closestDist){
-			closestDist = d;
-			closest = &containers[i];
+	glm::vec3 newNor = glm::normalize(splitNormal(out, va)*(1-lerp) + splitNormal(out, vb)*lerp);
+	out.norBuf.push_back(newNor.x);
+	out.norBuf.push_back(newNor.y);
+	out.norBuf.push_back(newNor.z);
+
+	//fix texBuf if it exists
+	if(texBuf.size() > 0){
+		for(int i = 0; i < 2; i++){
+			float tex1 = splitTexCoord(out, va, i);
+			float tex2 = splitTexCoord(out, vb, i);
+			out.texBuf.push_back(tex1*(1-lerp) + tex2*lerp);
 		}
 	}
 
-	return closest;
+	struct SeedDistances dist;
+	out.vertexToContainer.push_back(closestContainer(newP.x, newP.y, newP.z, dist));
+	out.seedDistances.push_back(dist);
+	out.vertexKeys.push_back(key);
+
+	int index = out.firstVertex + out.vertexToContainer.size() - 1;
+	out.edgeCache[key] = index;
+	return index;
+}
+
+void addSplitFace(struct FaceSplitBuffer &out, unsigned int cell, int v1, int v2, int v3)
+{
+	struct SplitFace face;
+	face.cell = cell;
+	face.verts[0] = v1;
+	face.verts[1] = v2;
+	face.verts[2] = v3;
+	out.faces.push_back(face);
 }
 
 /* 
 * checks if a point is right on the border of being in a voronoi container 
 * i.e., checks if point's actual container and the test container are the same distance away within an epsilon
 */
-bool Shape::isAlmostInContainer(int vertInd, struct VoronoiContainer *testContainer)
+bool Shape::isAlmostInContainer(const struct FaceSplitBuffer &out, int vertInd, const struct VoronoiContainer *testContainer) const
 {
-	struct VoronoiContainer *actualContainer = vertexToContainer[vertInd];
+	const struct VoronoiContainer *actualContainer = splitContainer(out, vertInd);
+	if(testContainer == actualContainer){
+		return true;
+	}
+
+	//distances to the two closest containers were saved when the vertex was assigned
+	const struct SeedDistances &dist = splitSeedDistances(out, vertInd);
 	float EPSILON = 0.0001;
-	float d1 = distance(posBuf[3*vertInd], posBuf[3*vertInd+1], posBuf[3*vertInd+2], testContainer->position.x, testContainer->position.y, testContainer->position.z);
-	float d2 = distance(posBuf[3*vertInd], posBuf[3*vertInd+1], posBuf[3*vertInd+2], actualContainer->position.x, actualContainer->position.y, actualContainer->position.z);
+	float d1;
+	if(testContainer - &voronoiPieces[0] == dist.second){
+		d1 = dist.secondDist;
+	}
+	else{
+		glm::vec3 p = splitPosition(out, vertInd);
+		d1 = distance(p.x, p.y, p.z, testContainer->position.x, testContainer->position.y, testContainer->position.z);
+	}
+	float d2 = dist.nearestDist;
 
 	return (abs(d1-d2) < EPSILON);
 }
@@ -351,146 +1028,450 @@ bool Shape::isAlmostInContainer(int vertInd, struct VoronoiContainer *testContai
 //genreates the points to split up a triangle that spans between two different voronoi containers
 //args are two containers, then index of vertex in first container, and indexes of two points in second container
 //v2_1 is clockwise from v1
-void Shape::createPointsBetween(struct VoronoiContainer *c1, struct VoronoiContainer *c2, int v1, int v2_1, int v2_2)
-{
-	glm::vec3 p1, p2_1, p2_2;
-	p1 = glm::vec3(posBuf[3*v1], posBuf[3*v1+1], posBuf[3*v1+2]);
-	p2_1 = glm::vec3( posBuf[3*v2_1], posBuf[3*v2_1+1], posBuf[3*v2_1+2]);
-	p2_2 = glm::vec3(posBuf[3*v2_2], posBuf[3*v2_2+1], posBuf[3*v2_2+2]);
-
-	//create first new point
-	float newP1Lerp = newPointLerp(c1, c2, p1, p2_1);
-	glm::vec3 newP1 = p1*(1-newP1Lerp) + p2_1*newP1Lerp;
-	posBuf.push_back(newP1.x);
-	posBuf.push_back(newP1.y);
-	posBuf.push_back(newP1.z);
-	int newP1Index = posBuf.size()/3-1;
-
-	//create second new point
-	float newP2Lerp = newPointLerp(c1, c2, p1, p2_2);
-	glm::vec3 newP2 = p1*(1-newP2Lerp) + p2_2*newP2Lerp;
-	posBuf.push_back(newP2.x);
-	posBuf.push_back(newP2.y);
-	posBuf.push_back(newP2.z);
-	int newP2Index = posBuf.size()/3-1;
-
-	//fix texBuf if it exists
-	if(texBuf.size() > 0){
-		float tex1, tex2;
-
-		//newP1 x, y
-		tex1 = texBuf[2*v1];
-		tex2 = texBuf[2*v2_1];
-		texBuf.push_back(tex1*(1-newP1Lerp) + tex2*newP1Lerp);
-		tex1 = texBuf[2*v1+1];
-		tex2 = texBuf[2*v2_1+1];
-		texBuf.push_back(tex1*(1-newP1Lerp) + tex2*newP1Lerp);
-
-		//newP2 x,y
-		tex1 = texBuf[2*v1];
-		tex2 = texBuf[2*v2_2];
-		texBuf.push_back(tex1*(1-newP2Lerp) + tex2*newP2Lerp);
-		tex1 = texBuf[2*v1+1];
-		tex2 = texBuf[2*v2_2+1];
-		texBuf.push_back(tex1*(1-newP2Lerp) + tex2*newP2Lerp);
-	}
-
-	struct VoronoiContainer *newP1Container = closestContainer(voronoiPieces, newP1.x, newP1.y, newP1.z);
-	vertexToContainer.push_back(newP1Container);
-	struct VoronoiContainer *newP2Container = closestContainer(voronoiPieces, newP2.x, newP2.y, newP2.z);
-	vertexToContainer.push_back(newP2Container);
-
-	if(isAlmostInContainer(newP1Index, c1) || isAlmostInContainer(newP1Index, c2)){
-		c2->adjacencies.insert(c1);
-		c1->adjacencies.insert(c2);
+void Shape::createPointsBetween(struct FaceSplitBuffer &out, const struct VoronoiContainer *c1, const struct VoronoiContainer *c2, int v1, int v2_1, int v2_2)
+{
+	//new points where the two edges leaving v1 cross into c2
+	int newP1Index = edgeSplitVertex(out, c1, c2, v1, v2_1);
+	int newP2Index = edgeSplitVertex(out, c1, c2, v1, v2_2);
+
+	if(isAlmostInContainer(out, newP1Index, c1) || isAlmostInContainer(out, newP1Index, c2)){
+		unsigned int ci1 = c1 - &voronoiPieces[0];
+		unsigned int ci2 = c2 - &voronoiPieces[0];
+		out.adjacencies.push_back(std::make_pair(std::min(ci1, ci2), std::max(ci1, ci2)));
 		
-		c2->faces.push_back(v2_2);
-		c2->faces.push_back(newP1Index);
-		c2->faces.push_back(v2_1);
-
-		// if(isAlmostInContainer(newP2Index, c1) || isAlmostInContainer(newP2Index, c2)){
-			c2->faces.push_back(newP2Index);
-			c2->faces.push_back(newP1Index);
-			c2->faces.push_back(v2_2);
-
-			c1->faces.push_back(v1);
-			c1->faces.push_back(newP1Index);
-			c1->faces.push_back(newP2Index);
-		// }
-		// else{
-		// 	checkFace(v1, newP1Index, newP2Index);
-		// 	checkFace(newP2Index, newP1Index, v2_2);
-		// }
-	}
-	// else if(isAlmostInContainer(newP2Index, c1) || isAlmostInContainer(newP2Index, c2))
-	// {
-	// 	c2->adjacencies.insert(c1);
-	// 	c1->adjacencies.insert(c2);
-
-	// 	checkFace(v1, newP1Index, newP2Index);
-	// 	checkFace(newP2Index, newP1Index, v2_2);
-	// 	checkFace(v2_2, newP1Index, v2_1);
-	// }
-	// else{
-	// 	checkFace(v1, newP1Index, newP2Index);
-	// 	checkFace(newP2Index, newP1Index, v2_2);
-	// 	checkFace(v2_2, newP1Index, v2_1);
-	// }
+		addSplitFace(out, ci2, v2_2, newP1Index, v2_1);
+		addSplitFace(out, ci2, newP2Index, newP1Index, v2_2);
+		addSplitFace(out, ci1, v1, newP1Index, newP2Index);
+	}
 }
 
 //check a face to see if it is all in same voronoi container or spans multiple and needs to be split
 //args are vertex indexes for 3 vertices on face
-void Shape::checkFace(int v1, int v2, int v3)
+void Shape::checkFace(struct FaceSplitBuffer &out, int v1, int v2, int v3)
 {
-	struct VoronoiContainer *c1, *c2, *c3;
+	const struct VoronoiContainer *c1, *c2, *c3;
 
-	c1 = vertexToContainer[v1];
-	c2 = vertexToContainer[v2];
-	c3 = vertexToContainer[v3];
+	c1 = splitContainer(out, v1);
+	c2 = splitContainer(out, v2);
+	c3 = splitContainer(out, v3);
 
 
-	if(isAlmostInContainer(v2, c1) && isAlmostInContainer(v3, c1)){
+	if(isAlmostInContainer(out, v2, c1) && isAlmostInContainer(out, v3, c1)){
 		// all in one container
-		c1->faces.push_back(v1);
-		c1->faces.push_back(v2);
-		c1->faces.push_back(v3);
+		addSplitFace(out, c1 - &voronoiPieces[0], v1, v2, v3);
 	}
-	else if(isAlmostInContainer(v3, c2) && isAlmostInContainer(v1, c2)){
+	else if(isAlmostInContainer(out, v3, c2) && isAlmostInContainer(out, v1, c2)){
 		// all in one container
-		c2->faces.push_back(v1);
-		c2->faces.push_back(v2);
-		c2->faces.push_back(v3);
+		addSplitFace(out, c2 - &voronoiPieces[0], v1, v2, v3);
 	}
-	else if(isAlmostInContainer(v1, c3) && isAlmostInContainer(v2, c3)){
+	else if(isAlmostInContainer(out, v1, c3) && isAlmostInContainer(out, v2, c3)){
 		// all in one container
-		c3->faces.push_back(v1);
-		c3->faces.push_back(v2);
-		c3->faces.push_back(v3);
+		addSplitFace(out, c3 - &voronoiPieces[0], v1, v2, v3);
 	}
 	//two cases where v1 and v2 are together
-	else if(isAlmostInContainer(v2, c1)){
-		createPointsBetween(c3, c1, v3, v1, v2);
+	else if(isAlmostInContainer(out, v2, c1)){
+		createPointsBetween(out, c3, c1, v3, v1, v2);
 	}
-	else if(isAlmostInContainer(v1, c2)){
-		createPointsBetween(c3, c2, v3, v1, v2);
+	else if(isAlmostInContainer(out, v1, c2)){
+		createPointsBetween(out, c3, c2, v3, v1, v2);
 	}
 	//two cases where v1 and v3 are together
-	else if(isAlmostInContainer(v3, c1)){
-		createPointsBetween(c2, c1, v2, v3, v1);
+	else if(isAlmostInContainer(out, v3, c1)){
+		createPointsBetween(out, c2, c1, v2, v3, v1);
 	}
-	else if(isAlmostInContainer(v1, c3)){
-		createPointsBetween(c2, c3, v2, v3, v1);
+	else if(isAlmostInContainer(out, v1, c3)){
+		createPointsBetween(out, c2, c3, v2, v3, v1);
 	}
 	//two cases where v2 and v3 are together
-	else if(isAlmostInContainer(v3, c2)){
-		createPointsBetween(c1, c2, v1, v2, v3);
+	else if(isAlmostInContainer(out, v3, c2)){
+		createPointsBetween(out, c1, c2, v1, v2, v3);
 	}
-	else if(isAlmostInContainer(v2, c3)){
-		createPointsBetween(c1, c3, v1, v2, v3);
+	else if(isAlmostInContainer(out, v2, c3)){
+		createPointsBetween(out, c1, c3, v1, v2, v3);
 	}
 	//case where they are all seperate
 	else{
-		createPointsBetween(c1, c2, v1, v2, v3);
+		createPointsBetween(out, c1, c2, v1, v2, v3);
+	}
+}
+
+//appends the output of every split buffer in thread order, giving the same result as a single thread
+//a vertex on an edge that was also split by an earlier buffer is replaced by that buffer's copy
+void Shape::mergeSplitBuffers(std::vector<struct FaceSplitBuffer> & buffers)
+{
+	//edge split points already placed by an earlier buffer, so a point on a block boundary is only added once
+	std::unordered_map<struct EdgeSplitKey, unsigned int, EdgeSplitKeyHash> placed;
+	std::vector<std::pair<unsigned int, unsigned int> > adjacentPairs;
+
+	//every cell's faces go in one range of eleBuf, in the order the buffers made them
+	//the split pass is done reading eleBuf so it can be replaced
+	std::vector<unsigned int> cellFill(voronoiPieces.size(), 0);
+	for(const struct FaceSplitBuffer & out : buffers){
+		for(const struct SplitFace & face : out.faces){
+			cellFill[face.cell] += 3;
+		}
+	}
+	unsigned int indexCount = 0;
+	for(unsigned int c = 0; c < voronoiPieces.size(); c++){
+		voronoiPieces[c].indexOffset = indexCount;
+		voronoiPieces[c].indexCount = cellFill[c];
+		cellFill[c] = indexCount;
+		indexCount += voronoiPieces[c].indexCount;
+	}
+	std::vector<unsigned int>(indexCount).swap(eleBuf);
+
+	for(struct FaceSplitBuffer & out : buffers){
+		//new vertices were numbered from firstVertex, find where each one actually lands
+		std::vector<unsigned int> finalIndex(out.vertexKeys.size());
+		for(unsigned int i = 0; i < out.vertexKeys.size(); i++){
+			std::unordered_map<struct EdgeSplitKey, unsigned int, EdgeSplitKeyHash>::iterator existing = placed.find(out.vertexKeys[i]);
+			if(existing != placed.end()){
+				finalIndex[i] = existing->second;
+				continue;
+			}
+
+			finalIndex[i] = posBuf.size()/3;
+			if(&out != &buffers.back()){
+				placed[out.vertexKeys[i]] = finalIndex[i];
+			}
+			posBuf.insert(posBuf.end(), out.posBuf.begin() + 3*i, out.posBuf.begin() + 3*i + 3);
+			norBuf.insert(norBuf.end(), out.norBuf.begin() + 3*i, out.norBuf.begin() + 3*i + 3);
+			if(!out.texBuf.empty()){
+				texBuf.insert(texBuf.end(), out.texBuf.begin() + 2*i, out.texBuf.begin() + 2*i + 2);
+			}
+		}
+
+		for(const struct SplitFace & face : out.faces){
+			unsigned int &fill = cellFill[face.cell];
+			for(int j = 0; j < 3; j++){
+				unsigned int v = face.verts[j];
+				eleBuf[fill++] = v < out.firstVertex ? v : finalIndex[v - out.firstVertex];
+			}
+		}
+
+		adjacentPairs.insert(adjacentPairs.end(), out.adjacencies.begin(), out.adjacencies.end());
+
+		out = FaceSplitBuffer();
+	}
+
+	buildAdjacency(adjacentPairs);
+}
+
+/*
+* builds the compressed sparse row adjacency from every border crossing found while splitting
+* pairs are sorted and deduplicated, then each cell's neighbours are packed one after another
+*/
+void Shape::buildAdjacency(std::vector<std::pair<unsigned int, unsigned int> > &pairs)
+{
+	std::sort(pairs.begin(), pairs.end());
+	pairs.erase(std::unique(pairs.begin(), pairs.end()), pairs.end());
+
+	//count both directions of each pair, then turn the counts into offsets
+	adjacencyOffsets.assign(voronoiPieces.size() + 1, 0);
+	for(const std::pair<unsigned int, unsigned int> & adjacent : pairs){
+		adjacencyOffsets[adjacent.first + 1]++;
+		adjacencyOffsets[adjacent.second + 1]++;
+	}
+	for(unsigned int c = 0; c < voronoiPieces.size(); c++){
+		adjacencyOffsets[c + 1] += adjacencyOffsets[c];
+	}
+
+	//pairs are sorted by their first cell, so filling in this order leaves every cell's list sorted
+	adjacencyCells.resize(adjacencyOffsets.back());
+	std::vector<unsigned int> fill(adjacencyOffsets.begin(), adjacencyOffsets.end() - 1);
+	for(const std::pair<unsigned int, unsigned int> & adjacent : pairs){
+		adjacencyCells[fill[adjacent.second]++] = adjacent.first;
+	}
+	for(const std::pair<unsigned int, unsigned int> & adjacent : pairs){
+		adjacencyCells[fill[adjacent.first]++] = adjacent.second;
+	}
+}
+
+/* cells have no neighbours once MESH_DROP_ALL has freed the adjacency */
+CellNeighbours Shape::getNeighbours(unsigned int cell) const
+{
+	CellNeighbours neighbours;
+	if(cell + 1 >= adjacencyOffsets.size()){
+		neighbours.first = neighbours.last = NULL;
+		return neighbours;
+	}
+	neighbours.first = adjacencyCells.data() + adjacencyOffsets[cell];
+	neighbours.last = adjacencyCells.data() + adjacencyOffsets[cell + 1];
+	return neighbours;
+}
+
+
+/* writes one section at a 16 byte aligned offset and records where it went */
+static void writeCacheSection(std::ofstream &out, struct MeshCacheHeader &header, int section, const void *data)
+{
+	size_t size = meshCacheSectionSize(header, section);
+	static const char padding[16] = {0};
+	uint64_t offset = (uint64_t)out.tellp();
+	uint64_t aligned = (offset + 15) & ~(uint64_t)15;
+	out.write(padding, aligned - offset);
+	header.sections[section] = aligned;
+	if(size > 0){
+		out.write((const char *)data, size);
+	}
+}
+
+/*
+* saves everything init uploads and drawing reads for a fractured shape, see MeshCache.h for the layout
+* written to a temporary file first so a crash never leaves a half written cache behind
+*/
+bool Shape::saveVoronoiCache(const std::string &path, uint64_t key) const
+{
+	if(!usingVoronoi || posBuf.empty() || eleBuf.empty()){
+		cerr << "only a fractured shape whose buffers have not been freed can be cached" << endl;
+		return false;
+	}
+
+	struct MeshCacheHeader header;
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, MeshCacheMagic, sizeof(header.magic));
+	header.version = MeshCacheVersion;
+	header.byteOrder = MeshCacheByteOrder;
+	header.key = key;
+	header.flags = (texBuf.empty() ? 0 : MESH_CACHE_TEXCOORDS) | (shortCellIndices ? MESH_CACHE_SHORT_INDICES : 0);
+	header.cellCount = voronoiPieces.size();
+	header.vertexCount = posBuf.size()/3;
+	header.indexCount = eleBuf.size();
+	header.adjacencyCount = adjacencyCells.size();
+
+	std::vector<struct MeshCacheCell> cells(voronoiPieces.size());
+	for(size_t i = 0; i < voronoiPieces.size(); i++){
+		const struct VoronoiContainer &piece = voronoiPieces[i];
+		struct MeshCacheCell &cell = cells[i];
+		for(int k = 0; k < 3; k++){
+			cell.position[k] = piece.position[k];
+			cell.rotationAxis[k] = piece.rotationAxis[k];
+			cell.normal[k] = piece.normal[k];
+			cell.vecToMaster[k] = piece.vecToMaster[k];
+		}
+		cell.indexOffset = piece.indexOffset;
+		cell.indexCount = piece.indexCount;
+		cell.baseVertex = piece.baseVertex;
+		cell.vertexCount = piece.vertexCount;
+		cell.boundRadius = piece.boundRadius;
+		cell.animationOffset = piece.animationOffset;
+	}
+
+	std::string tempPath = path + ".tmp";
+	std::ofstream out(tempPath.c_str(), std::ios::binary | std::ios::trunc);
+	if(!out){
+		cerr << "could not write mesh cache " << tempPath << endl;
+		return false;
+	}
+	//the header is written again once the section offsets are known
+	out.write((const char *)&header, sizeof(header));
+	writeCacheSection(out, header, MESH_CACHE_POSITIONS, posBuf.data());
+	writeCacheSection(out, header, MESH_CACHE_NORMALS, norBuf.data());
+	writeCacheSection(out, header, MESH_CACHE_TEXCOORDS_SECTION, texBuf.data());
+	writeCacheSection(out, header, MESH_CACHE_CELL_INDICES, cellBuf.data());
+	writeCacheSection(out, header, MESH_CACHE_ELEMENTS, shortCellIndices ? (const void *)cellEleBuf.data() : (const void *)eleBuf.data());
+	writeCacheSection(out, header, MESH_CACHE_CELLS, cells.data());
+	writeCacheSection(out, header, MESH_CACHE_ADJACENCY_OFFSETS, adjacencyOffsets.data());
+	writeCacheSection(out, header, MESH_CACHE_ADJACENCY_CELLS, adjacencyCells.data());
+	out.seekp(0);
+	out.write((const char *)&header, sizeof(header));
+	out.close();
+	if(!out){
+		cerr << "could not write mesh cache " << tempPath << endl;
+		remove(tempPath.c_str());
+		return false;
+	}
+
+	//rename does not replace an existing file everywhere
+	remove(path.c_str());
+	if(rename(tempPath.c_str(), path.c_str()) != 0){
+		cerr << "could not move mesh cache to " << path << endl;
+		remove(tempPath.c_str());
+		return false;
+	}
+	cout << "Saved voronoi mesh cache " << path << endl;
+	return true;
+}
+
+/*
+* checks the header, that every section and cell range lies inside the file and that every index
+* points at a vertex or cell that exists before anything is used
+* the cells and adjacency are copied out, the vertex and index streams are uploaded from the mapping by init
+*/
+bool Shape::loadVoronoiCache(const std::string &path, uint64_t key)
+{
+	std::unique_ptr<MappedFile> file(new MappedFile());
+	if(!file->open(path)){
+		return false;
+	}
+	if(file->size() < sizeof(struct MeshCacheHeader)){
+		cerr << "mesh cache " << path << " is truncated" << endl;
+		return false;
+	}
+
+	struct MeshCacheHeader header;
+	memcpy(&header, file->data(), sizeof(header));
+	if(memcmp(header.magic, MeshCacheMagic, sizeof(header.magic)) != 0 || header.byteOrder != MeshCacheByteOrder){
+		cerr << path << " is not a mesh cache for this machine" << endl;
+		return false;
+	}
+	if(header.version != MeshCacheVersion || header.key != key){
+		cout << "mesh cache " << path << " is out of date, regenerating" << endl;
+		return false;
+	}
+	if(header.vertexCount > 0xFFFFFFFFu || header.indexCount > 0xFFFFFFFFu || header.adjacencyCount > 0xFFFFFFFFu){
+		cerr << "mesh cache " << path << " is corrupt" << endl;
+		return false;
+	}
+	//no section can be bigger than the file, so bounding each count by it keeps the section sizes from overflowing
+	size_t elementSize = (header.flags & MESH_CACHE_SHORT_INDICES) ? sizeof(uint16_t) : sizeof(uint32_t);
+	if(header.vertexCount > file->size() / (3*sizeof(float)) || header.indexCount > file->size() / elementSize
+		|| header.cellCount > file->size() / sizeof(struct MeshCacheCell) || header.adjacencyCount > file->size() / sizeof(uint32_t)){
+		cerr << "mesh cache " << path << " is corrupt" << endl;
+		return false;
+	}
+	for(int section = 0; section < MESH_CACHE_SECTION_COUNT; section++){
+		uint64_t offset = header.sections[section];
+		uint64_t size = meshCacheSectionSize(header, section);
+		if(offset % 16 != 0 || offset < sizeof(header) || offset > file->size() || size > file->size() - offset){
+			cerr << "mesh cache " << path << " is corrupt" << endl;
+			return false;
+		}
+	}
+
+	const unsigned char *base = file->data();
+	const struct MeshCacheCell *cells = (const struct MeshCacheCell *)(base + header.sections[MESH_CACHE_CELLS]);
+	const unsigned int *offsets = (const unsigned int *)(base + header.sections[MESH_CACHE_ADJACENCY_OFFSETS]);
+	for(unsigned int i = 0; i < header.cellCount; i++){
+		const struct MeshCacheCell &cell = cells[i];
+		if((uint64_t)cell.indexOffset + cell.indexCount > header.indexCount || (uint64_t)cell.baseVertex + cell.vertexCount > header.vertexCount
+			|| offsets[i] > offsets[i+1]){
+			cerr << "mesh cache " << path << " is corrupt" << endl;
+			return false;
+		}
+	}
+	if(offsets[header.cellCount] != header.adjacencyCount){
+		cerr << "mesh cache " << path << " is corrupt" << endl;
+		return false;
+	}
+
+	//short indices are relative to their cell's first vertex, 32 bit ones to the whole mesh
+	bool indicesValid = true;
+	if(header.flags & MESH_CACHE_SHORT_INDICES){
+		const unsigned short *elements = (const unsigned short *)(base + header.sections[MESH_CACHE_ELEMENTS]);
+		for(unsigned int i = 0; i < header.cellCount && indicesValid; i++){
+			const struct MeshCacheCell &cell = cells[i];
+			for(uint32_t e = cell.indexOffset; e < cell.indexOffset + cell.indexCount; e++){
+				indicesValid = indicesValid && elements[e] < cell.vertexCount;
+			}
+		}
+	}
+	else{
+		const unsigned int *elements = (const unsigned int *)(base + header.sections[MESH_CACHE_ELEMENTS]);
+		for(uint64_t e = 0; e < header.indexCount; e++){
+			indicesValid = indicesValid && elements[e] < header.vertexCount;
+		}
+	}
+	const unsigned int *vertexCells = (const unsigned int *)(base + header.sections[MESH_CACHE_CELL_INDICES]);
+	for(uint64_t v = 0; v < header.vertexCount; v++){
+		indicesValid = indicesValid && vertexCells[v] < header.cellCount;
+	}
+	const unsigned int *neighbours = (const unsigned int *)(base + header.sections[MESH_CACHE_ADJACENCY_CELLS]);
+	for(uint64_t a = 0; a < header.adjacencyCount; a++){
+		indicesValid = indicesValid && neighbours[a] < header.cellCount;
+	}
+	if(!indicesValid){
+		cerr << "mesh cache " << path << " is corrupt" << endl;
+		return false;
+	}
+
+	voronoiPieces.resize(header.cellCount);
+	for(unsigned int i = 0; i < header.cellCount; i++){
+		const struct MeshCacheCell &cell = cells[i];
+		struct VoronoiContainer &piece = voronoiPieces[i];
+		piece.position = glm::vec3(cell.position[0], cell.position[1], cell.position[2]);
+		piece.rotationAxis = glm::vec3(cell.rotationAxis[0], cell.rotationAxis[1], cell.rotationAxis[2]);
+		piece.normal = glm::vec3(cell.normal[0], cell.normal[1], cell.normal[2]);
+		piece.vecToMaster = glm::vec3(cell.vecToMaster[0], cell.vecToMaster[1], cell.vecToMaster[2]);
+		piece.indexOffset = cell.indexOffset;
+		piece.indexCount = cell.indexCount;
+		piece.baseVertex = cell.baseVertex;
+		piece.vertexCount = cell.vertexCount;
+		piece.boundRadius = cell.boundRadius;
+		piece.animationOffset = cell.animationOffset;
+	}
+	adjacencyOffsets.assign(offsets, offsets + header.cellCount + 1);
+	adjacencyCells.assign(neighbours, neighbours + header.adjacencyCount);
+
+	cachedStreams = MeshStreams();
+	cachedStreams.vertexCount = header.vertexCount;
+	cachedStreams.pos = (const float *)(base + header.sections[MESH_CACHE_POSITIONS]);
+	cachedStreams.nor = (const float *)(base + header.sections[MESH_CACHE_NORMALS]);
+	cachedStreams.tex = (header.flags & MESH_CACHE_TEXCOORDS) ? (const float *)(base + header.sections[MESH_CACHE_TEXCOORDS_SECTION]) : NULL;
+	cachedStreams.cell = (const unsigned int *)(base + header.sections[MESH_CACHE_CELL_INDICES]);
+	cachedStreams.indexCount = header.indexCount;
+	shortCellIndices = (header.flags & MESH_CACHE_SHORT_INDICES) != 0;
+	if(shortCellIndices){
+		cachedStreams.shortEle = (const unsigned short *)(base + header.sections[MESH_CACHE_ELEMENTS]);
+	}
+	else{
+		cachedStreams.ele = (const unsigned int *)(base + header.sections[MESH_CACHE_ELEMENTS]);
+	}
+	meshCache = std::move(file);
+
+	usingVoronoi = true;
+	createRotateAnimation();
+	buildCellDrawRanges();
+	cellAnimation.build(voronoiPieces);
+	cout << "Loaded voronoi mesh cache " << path << ": " << header.cellCount << " cells, " << header.vertexCount << " vertices" << endl;
+	return true;
+}
+
+/*
+* gives every vertex exactly one owning cell and fills cellBuf with it
+* a vertex used by faces in more than one cell is copied so each cell gets its own
+* needed so the batched draw can find a vertex's transform from its cell index alone
+*/
+void Shape::separateCellVertices()
+{
+	const unsigned int NO_CELL = 0xFFFFFFFF;
+	size_t vertCount = posBuf.size()/3;
+	cellBuf.assign(vertCount, NO_CELL);
+
+	//cells are handled one at a time, so one remembered copy per vertex is enough
+	std::vector<unsigned int> copyCell(vertCount, NO_CELL);
+	std::vector<unsigned int> copyIndex(vertCount);
+
+	for(unsigned int c = 0; c < voronoiPieces.size(); c++){
+		const struct VoronoiContainer &piece = voronoiPieces[c];
+		for(unsigned int i = piece.indexOffset; i < piece.indexOffset + piece.indexCount; i++){
+			unsigned int &v = eleBuf[i];
+			if(cellBuf[v] == NO_CELL){
+				cellBuf[v] = c;
+			}
+			else if(cellBuf[v] != c){
+				if(copyCell[v] != c){
+					copyCell[v] = c;
+					copyIndex[v] = posBuf.size()/3;
+					for(int j = 0; j < 3; j++){
+						posBuf.push_back(posBuf[3*v+j]);
+						norBuf.push_back(norBuf[3*v+j]);
+					}
+					if(!texBuf.empty()){
+						texBuf.push_back(texBuf[2*v]);
+						texBuf.push_back(texBuf[2*v+1]);
+					}
+					cellBuf.push_back(c);
+				}
+				v = copyIndex[v];
+			}
+		}
+	}
+
+	//vertices no face uses still need a valid cell
+	for(unsigned int & cell : cellBuf){
+		if(cell == NO_CELL){
+			cell = 0;
+		}
 	}
 }
 
@@ -502,8 +1483,6 @@ void Shape::createVoronoiContainers(std::vector<glm::vec3> seeds)
 		return;
 	}
 
-	auto S = std::make_shared<MatrixStack>();
-
 	for(unsigned int i = 0; i < seeds.size(); i++){
 		struct VoronoiContainer newPiece;
 		newPiece.position = seeds[i];
@@ -517,44 +1496,112 @@ void Shape::createVoronoiContainers(std::vector<glm::vec3> seeds)
 		//also update master so it points in the general direction of all others
 		voronoiPieces[0].vecToMaster += (seeds[0] - seeds[i]);
 	}
+
+	//spatial index over the seeds so closest container lookups don't scan every piece
+	seedTree.build(seeds);
 }
 
 //public function that is called on shape to setup everything voronoi
 void Shape::generateVoronoi(std::vector<glm::vec3> seeds)
 {
 	usingVoronoi = true;
-	generateNormals();
+	//loaders that already made normals, like Terrain::loadImage, are not redone
+	if(norBuf.size() != posBuf.size()){
+		generateNormals();
+	}
 	createVoronoiContainers(seeds);
 	createRotateAnimation();
 
 	//go through every point and determine which container it falls in
-	for(unsigned int i = 0; i < posBuf.size()/3; i++){
-		struct VoronoiContainer *closest = closestContainer(voronoiPieces, posBuf[3*i], posBuf[3*i+1], posBuf[3*i+2]);
-		closest->normal += glm::vec3(norBuf[3*i], norBuf[3*i+1], norBuf[3*i+2]);
-		vertexToContainer.push_back(closest);
+	//lookups are independent so they are split across threads
+	size_t vertCount = posBuf.size()/3;
+	vertexToContainer.resize(vertCount);
+	vertexSeedDistances.resize(vertCount);
+	parallelFor(vertCount, threadCount, [this](size_t begin, size_t end, unsigned int thread){
+		for(size_t i = begin; i < end; i++){
+			vertexToContainer[i] = closestContainer(posBuf[3*i], posBuf[3*i+1], posBuf[3*i+2], vertexSeedDistances[i]);
+		}
+	});
+
+	//normals are summed in vertex order so the result is the same for any thread count
+	for(size_t i = 0; i < vertCount; i++){
+		voronoiPieces[vertexToContainer[i]].normal += glm::vec3(norBuf[3*i], norBuf[3*i+1], norBuf[3*i+2]);
 	}
 
 	//go through every face and split the faces so all points are in the same conatiner
-	for(unsigned int i = 0; i < eleBuf.size()/3; i++){
-		int v1, v2, v3;
-		v1 = eleBuf[3*i];
-		v2 = eleBuf[3*i+1];
-		v3 = eleBuf[3*i+2];
-		checkFace(v1, v2, v3);
+	//each thread splits a block of faces into its own buffer, then the buffers are merged in order
+	unsigned int threads = resolveThreadCount(threadCount);
+	std::vector<struct FaceSplitBuffer> splitBuffers(threads);
+	for(struct FaceSplitBuffer & out : splitBuffers){
+		out.firstVertex = vertCount;
 	}
+	parallelFor(eleBuf.size()/3, threads, [this, &splitBuffers](size_t begin, size_t end, unsigned int thread){
+		struct FaceSplitBuffer &out = splitBuffers[thread];
+		for(size_t i = begin; i < end; i++){
+			int v1, v2, v3;
+			v1 = eleBuf[3*i];
+			v2 = eleBuf[3*i+1];
+			v3 = eleBuf[3*i+2];
+			checkFace(out, v1, v2, v3);
+		}
+	});
+	mergeSplitBuffers(splitBuffers);
 
-	//update element buffer with all the new faces
-	eleBuf.clear();
-	for(unsigned int i = 0; i < voronoiPieces.size(); i++){
-		voronoiPieces[i].faceOffset = eleBuf.size();
-		eleBuf.insert(eleBuf.end(), voronoiPieces[i].faces.begin(), voronoiPieces[i].faces.end());
-		voronoiPieces[i].normal = glm::normalize(voronoiPieces[i].normal);
+	//the seed lookups and vertex assignments are only needed while splitting
+	std::vector<struct SeedDistances>().swap(vertexSeedDistances);
+	std::vector<unsigned int>().swap(vertexToContainer);
+	seedTree.clear();
+
+	separateCellVertices();
+	groupCellVertices();
+	computeCellBounds();
+	buildCellIndices();
+
+	for(struct VoronoiContainer & container : voronoiPieces){
+		container.normal = glm::normalize(container.normal);
 	}
 
 	//set the rotation axis for each voronoi piece
 	for(struct VoronoiContainer & container : voronoiPieces){
 		container.rotationAxis = glm::cross(container.vecToMaster, container.normal);
 	}
+
+	cellAnimation.build(voronoiPieces);
+}
+
+/*
+* uploads what the shader needs to animate each cell itself, 2 texels per cell:
+* (position, animationOffset) and (rotationAxis, 0)
+* this never changes so it is only done once
+*/
+void Shape::uploadCellData()
+{
+	std::vector<glm::vec4> cellData;
+	cellData.reserve(2*voronoiPieces.size());
+	for(const struct VoronoiContainer & piece : voronoiPieces){
+		cellData.push_back(glm::vec4(piece.position, piece.animationOffset));
+		cellData.push_back(glm::vec4(piece.rotationAxis, 0));
+	}
+
+	glGenBuffers(1, &cellDataBufID);
+	glBindBuffer(GL_TEXTURE_BUFFER, cellDataBufID);
+	glBufferData(GL_TEXTURE_BUFFER, cellData.size()*sizeof(glm::vec4), &cellData[0], GL_STATIC_DRAW);
+	glGenTextures(1, &cellDataTexID);
+	glBindTexture(GL_TEXTURE_BUFFER, cellDataTexID);
+	glTexBuffer(GL_TEXTURE_BUFFER, GL_RGBA32F, cellDataBufID);
+	glBindTexture(GL_TEXTURE_BUFFER, 0);
+	glBindBuffer(GL_TEXTURE_BUFFER, 0);
+
+	if(rotateAnim->getKeyFrames().size() > MaxShaderKeyFrames){
+		std::cerr << "Too many key frames for the GPU animated voronoi draw" << std::endl;
+	}
+}
+
+//computes the S matrix of every cell for the current time into cellTransforms
+void Shape::updateCellTransforms() const
+{
+	cellTransforms.resize(voronoiPieces.size());
+	cellAnimation.evaluate(rotateAnim->getKeyFrames(), glfwGetTime(), &cellTransforms[0]);
 }
 
 //special case of draw for voronoi pieces
@@ -562,59 +1609,69 @@ void Shape::generateVoronoi(std::vector<glm::vec3> seeds)
 // i.e. P*V*M*S*vertPos
 void Shape::drawVoronoi(const std::shared_ptr<Program> prog) const
 {
-	int h_pos, h_nor, h_tex;
-	h_pos = h_nor = h_tex = -1;
+	int h_pos, h_nor, h_tex, h_cell;
+	const struct ShapeDrawHandles &h = drawHandles(*prog);
 
     glBindVertexArray(vaoID);
-	// Bind position buffer
-	h_pos = prog->getAttribute("vertPos");
-	GLSL::enableVertexAttribArray(h_pos);
-	glBindBuffer(GL_ARRAY_BUFFER, posBufID);
-	glVertexAttribPointer(h_pos, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
-	
-	// Bind normal buffer
-	h_nor = prog->getAttribute("vertNor");
-	if(h_nor != -1 && norBufID != 0) {
-		GLSL::enableVertexAttribArray(h_nor);
-		glBindBuffer(GL_ARRAY_BUFFER, norBufID);
-		glVertexAttribPointer(h_nor, 3, GL_FLOAT, GL_FALSE, 0, (const void *)0);
-	}
-
-	if (texBufID != 0) {	
-		// Bind texcoords buffer
-		h_tex = prog->getAttribute("vertTex");
-		if(h_tex != -1 && texBufID != 0) {
-			GLSL::enableVertexAttribArray(h_tex);
-			glBindBuffer(GL_ARRAY_BUFFER, texBufID);
-			glVertexAttribPointer(h_tex, 2, GL_FLOAT, GL_FALSE, 0, (const void *)0);
-		}
-	}
+	bindVertexAttributes(*prog, h, h_pos, h_nor, h_tex, h_cell);
 	
 	// Bind element buffer
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
 	
-	// Draw
-	auto S = std::make_shared<MatrixStack>();
-	float totTime = rotateAnim->getTotalTime();
-	for(struct VoronoiContainer piece : voronoiPieces){
-		S->loadIdentity();
-		//move to origin, rotate, move back
-		S->translate(1.0f*piece.position);
-		S->multMatrix(rotateAnim->getTransform(fmod(glfwGetTime() + piece.animationOffset, totTime), piece.rotationAxis));
-		S->translate(-1.0f*piece.position);
-		
-		glUniformMatrix4fv(prog->getUniform("S"), 1, GL_FALSE, glm::value_ptr(S->topMatrix()));
-		glDrawElements(GL_TRIANGLES, (int)piece.faces.size(), GL_UNSIGNED_INT, (void *)(sizeof(unsigned int) * piece.faceOffset));
+	// Draw, leaving out the cells outside the view
+	cullCells();
+	if(voronoiDrawMode == VORONOI_DRAW_GPU_ANIMATED) {
+		//cell data is already on the GPU, only the time and key frames are sent
+		const std::vector<struct KeyFrame> &keyFrames = rotateAnim->getKeyFrames();
+		int keyFrameCount = keyFrames.size() < MaxShaderKeyFrames ? keyFrames.size() : MaxShaderKeyFrames;
+		glm::vec2 keyFrameData[MaxShaderKeyFrames];
+		for(int i = 0; i < keyFrameCount; i++){
+			keyFrameData[i] = glm::vec2(keyFrames[i].time, keyFrames[i].rotation);
+		}
+		glUniform2fv(prog->getUniform(h.keyFrames), keyFrameCount, &keyFrameData[0].x);
+		glUniform1i(prog->getUniform(h.keyFrameCount), keyFrameCount);
+		glUniform1f(prog->getUniform(h.animTime), (float)glfwGetTime());
+		glActiveTexture(GL_TEXTURE0 + CellBufferUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, cellDataTexID);
+		glUniform1i(prog->getUniform(h.cellData), CellBufferUnit);
+		glUniform1i(prog->getUniform(h.cellMode), 2);
+
+		drawVisibleCells();
+		drawCallCount = visibleCells.empty() ? 0 : 1;
+
+		glUniform1i(prog->getUniform(h.cellMode), 0);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glActiveTexture(GL_TEXTURE0);
 	}
-
-	// Disable and unbind
-	if(h_tex != -1) {
-		GLSL::disableVertexAttribArray(h_tex);
+	else if(voronoiDrawMode == VORONOI_DRAW_BATCHED) {
+		//upload every cell's transform and let the shader look it up by vertCell
+		updateCellTransforms();
+		glBindBuffer(GL_TEXTURE_BUFFER, cellTransformBufID);
+		glBufferData(GL_TEXTURE_BUFFER, cellTransforms.size()*sizeof(glm::mat4), NULL, GL_STREAM_DRAW);
+		glBufferSubData(GL_TEXTURE_BUFFER, 0, cellTransforms.size()*sizeof(glm::mat4), &cellTransforms[0]);
+		glBindBuffer(GL_TEXTURE_BUFFER, 0);
+		glActiveTexture(GL_TEXTURE0 + CellBufferUnit);
+		glBindTexture(GL_TEXTURE_BUFFER, cellTransformTexID);
+		glUniform1i(prog->getUniform(h.cellTransforms), CellBufferUnit);
+		glUniform1i(prog->getUniform(h.cellMode), 1);
+
+		drawVisibleCells();
+		drawCallCount = visibleCells.empty() ? 0 : 1;
+
+		glUniform1i(prog->getUniform(h.cellMode), 0);
+		glBindTexture(GL_TEXTURE_BUFFER, 0);
+		glActiveTexture(GL_TEXTURE0);
 	}
-	if(h_nor != -1) {
-		GLSL::disableVertexAttribArray(h_nor);
+	else {
+		updateCellTransforms();
+		for(unsigned int i : visibleCells){
+			glUniformMatrix4fv(prog->getUniform(h.S), 1, GL_FALSE, glm::value_ptr(cellTransforms[i]));
+			drawCell(i);
+		}
+		drawCallCount = visibleCells.size();
 	}
-	GLSL::disableVertexAttribArray(h_pos);
-	glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+	// Disable and unbind
+	unbindVertexAttributes(h_pos, h_nor, h_tex, h_cell);
 	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
 }
\ No newline at end of file
@@ -4,30 +4,140 @@
 
 #include <string>
 #include <vector>
-#include <set>
+#include <unordered_map>
+#include <utility>
 #include <memory>
+#include <cstdint>
 #include <glm/gtc/type_ptr.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <tiny_obj_loader/tiny_obj_loader.h>
+#include "KdTree.h"
+#include "CellAnimation.h"
+#include "Program.h"
 
 using namespace glm;
 
 typedef float (*AnimationFunction)(float distance);
 
-class Program;
+//program locations the draw functions use, resolved again only when drawn with a different program
+struct ShapeDrawHandles
+{
+	const Program *program = NULL;
+	AttributeHandle vertPos, vertNor, vertTex, vertCell;
+	UniformHandle S, cellMode, cellTransforms, cellData, animTime, keyFrames, keyFrameCount;
+};
 
 struct VoronoiContainer
 {
 	glm::vec3 position; //seed point
-	std::vector<unsigned int> faces;
-    unsigned int faceOffset;
+	unsigned int indexOffset; //the cell's triangles are eleBuf[indexOffset, indexOffset + indexCount)
+	unsigned int indexCount;
+	unsigned int baseVertex; //the cell's vertices are contiguous starting here
+	unsigned int vertexCount;
+	float boundRadius; //every vertex stays this close to position however the cell rotates around it
 
     glm::vec3 rotationAxis;
     float animationOffset;
     glm::vec3 normal;
 	glm::vec3 vecToMaster;
 
-    std::set<struct VoronoiContainer *> adjacencies;
+};
+
+//distances from a vertex to its two closest seeds, filled in when the vertex is assigned to a container
+//lets face classification reuse them instead of recomputing
+struct SeedDistances
+{
+	float nearestDist;
+	float secondDist;
+	int second; //index into voronoiPieces, -1 if there is only one piece
+};
+
+//a face produced by the split pass, waiting to be added to its container
+struct SplitFace
+{
+	unsigned int cell; //index into voronoiPieces
+	unsigned int verts[3];
+};
+
+//identifies the point where an edge crosses the border between two cells
+//both pairs are stored lowest first so either triangle on the edge builds the same key
+struct EdgeSplitKey
+{
+	unsigned int vLo, vHi;
+	unsigned int cLo, cHi;
+
+	bool operator==(const struct EdgeSplitKey &other) const
+	{
+		return vLo == other.vLo && vHi == other.vHi && cLo == other.cLo && cHi == other.cHi;
+	}
+};
+
+struct EdgeSplitKeyHash
+{
+	size_t operator()(const struct EdgeSplitKey &key) const
+	{
+		size_t h = key.vLo;
+		h = h*31 + key.vHi;
+		h = h*31 + key.cLo;
+		h = h*31 + key.cHi;
+		return h;
+	}
+};
+
+//per thread output of the face split pass
+struct FaceSplitBuffer
+{
+	unsigned int firstVertex; //index given to the first vertex created in this buffer
+	std::vector<float> posBuf;
+	std::vector<float> norBuf;
+	std::vector<float> texBuf;
+	std::vector<unsigned int> vertexToContainer; //index into voronoiPieces
+	std::vector<struct SeedDistances> seedDistances;
+	std::vector<struct EdgeSplitKey> vertexKeys; //edge each new vertex was created on
+	std::unordered_map<struct EdgeSplitKey, int, EdgeSplitKeyHash> edgeCache;
+	std::vector<struct SplitFace> faces;
+	std::vector<std::pair<unsigned int, unsigned int> > adjacencies; //cell index pairs, lower index first
+};
+
+class MappedFile;
+
+//the vertex and index arrays init sends to the GPU, pointing into the buffers or into a mapped mesh cache
+struct MeshStreams
+{
+	size_t vertexCount = 0;
+	const float *pos = NULL;
+	const float *nor = NULL;
+	const float *tex = NULL; //NULL when there are no texcoords
+	const unsigned int *cell = NULL; //NULL unless fractured
+	size_t indexCount = 0;
+	const unsigned int *ele = NULL; //NULL when shortEle is used
+	const unsigned short *shortEle = NULL; //relative to each cell's base vertex
+};
+
+//read only view of one cell's neighbours, usable in a range for
+struct CellNeighbours
+{
+	const unsigned int *first;
+	const unsigned int *last;
+	const unsigned int *begin() const { return first; }
+	const unsigned int *end() const { return last; }
+	size_t size() const { return last - first; }
+};
+
+//how drawVoronoi submits the cells
+enum VoronoiDrawMode
+{
+	VORONOI_DRAW_PER_CELL, //one S uniform and draw call per cell
+	VORONOI_DRAW_BATCHED, //all cell transforms uploaded to a buffer texture, one draw call
+	VORONOI_DRAW_GPU_ANIMATED //cell data and key frames uploaded once, shader animates from a time uniform, one draw call
+};
+
+//what init keeps of the CPU side mesh once it has been sent to the GPU
+enum MeshResidency
+{
+	MESH_KEEP_ALL, //keep every buffer, the shape can still be measured, resized or optimized
+	MESH_DROP_ALL, //free everything drawing does not need
+	MESH_KEEP_QUERIES //free the mesh but keep what the shape's queries read, like the terrain's heights and cell neighbours
 };
 
 struct KeyFrame
@@ -57,6 +167,11 @@ struct RotateAnimation
 		return glm::rotate(glm::mat4(1.0), keyFrames[keyFrames.size()-1].rotation, axis);
 	}
 
+	const std::vector<struct KeyFrame> &getKeyFrames() const
+	{
+		return keyFrames;
+	}
+
 	float getTotalTime()
 	{
 		return keyFrames.back().time;
@@ -94,7 +209,27 @@ public:
 	void resize(float scaleX, float shiftX, float scaleY, float shiftY, float scaleZ, float shiftZ);
 	void draw(const std::shared_ptr<Program> prog) const;
 	void generateVoronoi(std::vector<glm::vec3> seeds);
+	void optimizeMesh();
+	//writes the fractured mesh, ready to upload, to path under key, call after generateVoronoi and before init frees anything
+	bool saveVoronoiCache(const std::string &path, uint64_t key) const;
+	//maps a cache saved under the same key instead of generateVoronoi, init then uploads straight from the file
+	//returns false, leaving the shape as it was, if there is no cache or it was made from something else
+	bool loadVoronoiCache(const std::string &path, uint64_t key);
 	void setAnimationFunction(AnimationFunction func);
+	void setThreadCount(unsigned int count);
+	void setPackedVertices(bool packed) { packedVertices = packed; }
+	//applied at the end of init, so it has to be set before
+	void setResidency(MeshResidency policy) { residency = policy; }
+	MeshResidency getResidency() const { return residency; }
+	//P*V*M the shape will be drawn with, lets draw skip parts outside the view
+	void setCullMatrix(const glm::mat4 &clip) { cullMatrix = clip; cullingEnabled = true; }
+	void setVoronoiDrawMode(VoronoiDrawMode mode) { voronoiDrawMode = mode; }
+	VoronoiDrawMode getVoronoiDrawMode() const { return voronoiDrawMode; }
+	unsigned int getDrawCallCount() const { return drawCallCount; }
+	unsigned int getCellCount() const { return voronoiPieces.size(); }
+	unsigned int getCellsDrawn() const { return visibleCells.size(); }
+	//indices of the cells sharing a border with cell, in increasing order, empty after MESH_DROP_ALL
+	CellNeighbours getNeighbours(unsigned int cell) const;
 	glm::vec3 min;
 	glm::vec3 max;
 	
@@ -103,12 +238,35 @@ protected:
 	std::vector<float> posBuf;
 	std::vector<float> norBuf;
 	std::vector<float> texBuf;
+	std::vector<unsigned int> cellBuf;
 	unsigned eleBufID;
 	unsigned posBufID;
 	unsigned norBufID;
 	unsigned texBufID;
+	unsigned cellBufID;
+	unsigned packedBufID;
 	unsigned vaoID;
+	bool packedVertices = false;
+	unsigned int elementCount = 0; //eleBuf's size when uploaded, it may be freed after
+	bool hasTexCoords = false;
+	MeshResidency residency = MESH_KEEP_ALL;
+	void upload();
+	void applyResidency();
+	virtual size_t cpuMeshBytes() const;
+	virtual void releaseCpuMesh();
+	template<typename T> static size_t bufferBytes(const std::vector<T> &buf) { return buf.capacity()*sizeof(T); }
+	template<typename T> static void releaseBuffer(std::vector<T> &buf) { std::vector<T>().swap(buf); }
+	glm::mat4 cullMatrix;
+	bool cullingEnabled = false;
 	void generateNormals();
+	bool canPackVertices(const struct MeshStreams &streams) const;
+	void createVertexBuffers(size_t vertexCount, bool texCoords);
+	void uploadVertices(size_t first, const struct MeshStreams &streams);
+	struct MeshStreams meshStreams() const;
+	std::unique_ptr<MappedFile> meshCache; //open from loadVoronoiCache until init has uploaded it
+	struct MeshStreams cachedStreams; //into meshCache
+	void bindVertexAttributes(const Program &prog, const struct ShapeDrawHandles &h, int &h_pos, int &h_nor, int &h_tex, int &h_cell) const;
+	void unbindVertexAttributes(int h_pos, int h_nor, int h_tex, int h_cell) const;
 
 	vec3 matAmb;
 	vec3 matDiff;
@@ -117,15 +275,59 @@ protected:
 
 	std::vector<struct VoronoiContainer> voronoiPieces;
 	void drawVoronoi(const std::shared_ptr<Program> prog) const;
+	void updateCellTransforms() const;
+	const struct ShapeDrawHandles &drawHandles(const Program &prog) const;
+	mutable struct ShapeDrawHandles handles;
+	void uploadCellData();
 	bool usingVoronoi = false;
-	std::vector<struct VoronoiContainer *> vertexToContainer;
+	VoronoiDrawMode voronoiDrawMode = VORONOI_DRAW_PER_CELL;
+	unsigned cellTransformBufID = 0;
+	unsigned cellTransformTexID = 0;
+	unsigned cellDataBufID = 0;
+	unsigned cellDataTexID = 0;
+	CellAnimationBatch cellAnimation;
+	mutable std::vector<glm::mat4> cellTransforms;
+	mutable unsigned int drawCallCount = 0;
+	std::vector<unsigned int> vertexToContainer; //index into voronoiPieces, only kept while splitting
+	std::vector<struct SeedDistances> vertexSeedDistances;
+	KdTree seedTree;
 	void createVoronoiContainers(std::vector<glm::vec3> seeds);
+	unsigned int closestContainer(float x, float y, float z, struct SeedDistances &dist);
 	void createRotateAnimation();
-	bool isAlmostInContainer(int vertInd, struct VoronoiContainer *testContainer);
-	void checkFace(int v1, int v2, int v3);
-	void createPointsBetween(struct VoronoiContainer *c1, struct VoronoiContainer *c2, int v1, int v2_1, int v2_2);
+	glm::vec3 splitPosition(const struct FaceSplitBuffer &out, int v) const;
+	float splitTexCoord(const struct FaceSplitBuffer &out, int v, int component) const;
+	glm::vec3 splitNormal(const struct FaceSplitBuffer &out, int v) const;
+	const struct VoronoiContainer *splitContainer(const struct FaceSplitBuffer &out, int v) const;
+	const struct SeedDistances &splitSeedDistances(const struct FaceSplitBuffer &out, int v) const;
+	int edgeSplitVertex(struct FaceSplitBuffer &out, const struct VoronoiContainer *c1, const struct VoronoiContainer *c2, int va, int vb);
+	bool isAlmostInContainer(const struct FaceSplitBuffer &out, int vertInd, const struct VoronoiContainer *testContainer) const;
+	void checkFace(struct FaceSplitBuffer &out, int v1, int v2, int v3);
+	void createPointsBetween(struct FaceSplitBuffer &out, const struct VoronoiContainer *c1, const struct VoronoiContainer *c2, int v1, int v2_1, int v2_2);
+	void mergeSplitBuffers(std::vector<struct FaceSplitBuffer> & buffers);
+	void buildAdjacency(std::vector<std::pair<unsigned int, unsigned int> > &pairs);
+	std::vector<unsigned int> adjacencyOffsets; //cell c's neighbours are adjacencyCells[adjacencyOffsets[c]] up to adjacencyOffsets[c+1]
+	std::vector<unsigned int> adjacencyCells;
+	void separateCellVertices();
+	void groupCellVertices();
+	void remapVertices(const std::vector<unsigned int> &order);
+	void buildCellIndices();
+	void buildCellDrawRanges();
+	void computeCellBounds();
+	void cullCells() const;
+	void drawCell(unsigned int cell) const;
+	void drawVisibleCells() const;
+	mutable std::vector<unsigned int> visibleCells; //the rest are reused every frame for the single call draw
+	mutable std::vector<int> visibleCounts;
+	mutable std::vector<const void *> visibleOffsets;
+	mutable std::vector<int> visibleBaseVertices;
+	std::vector<unsigned short> cellEleBuf; //eleBuf relative to each cell's baseVertex, empty if a cell does not fit in 16 bits
+	bool shortCellIndices = false; //whether cellEleBuf was uploaded instead of eleBuf
+	std::vector<int> cellIndexCounts;
+	std::vector<const void *> cellIndexOffsets;
+	std::vector<int> cellBaseVertices;
 	std::shared_ptr<struct RotateAnimation> rotateAnim;
 	AnimationFunction animOffsetFunction;
+	unsigned int threadCount = 0;
 };
 
 #endif
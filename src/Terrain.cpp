@@ -1,168 +1,1239 @@
-#include "Terrain.h"
-#include "MatrixStack.h"
-#include <stdio.h>
-#include <stdlib.h>
-#include <iostream>
-
-#include "GLSL.h"
-#include "Program.h"
-
-#include "stb_image.h"
-
-#define GLM_ENABLE_EXPERIMENTAL
-#include <glm/gtc/type_ptr.hpp>
-#include <glm/gtx/transform.hpp>
-#include <GLFW/glfw3.h>
-
-int imgWidth, imgHeight;
-float *heights;
-
-
-void Terrain::loadImage(const std::string &heightMap)
-{
-    // Load heightmap image
-	int w, h, ncomps;
-	stbi_set_flip_vertically_on_load(true);
-	unsigned char *data = stbi_load(heightMap.c_str(), &w, &h, &ncomps, 0);
-	if(! data)
-	{
-		std::cerr << heightMap << " not found" << std::endl;
-	}
-	imgWidth = w;
-	imgHeight = h;
-	heights = (float*)malloc(sizeof(float) * imgWidth * imgHeight);
-
-	for(int i = 0; i < w*h; i ++){
-		//get height as value between 0 and 1
-		float curHeight;
-		//convert rgb to greyscale
-		if(ncomps == 3){
-			curHeight = (data[i*3]*0.3 + data[i*3+1]*0.59 + data[i*3+2]*0.11)/255.0;
-		}
-		//convert rgba to greyscale
-		if(ncomps == 4){
-			curHeight = (data[i*4]*0.3 + data[i*4+1]*0.59 + data[i*4+2]*0.11)/255.0;
-		}
-		//just use greyscale
-		else if(ncomps == 1){
-			curHeight = data[i]/255.0;
-		}
-		//???
-		else{
-			std::cerr << "Weird number of color components" << std::endl;
-			break;
-		}
-		
-		posBuf.push_back(-1 + 2*(i%w)/(float)w); //x
-		posBuf.push_back(curHeight); //y
-		posBuf.push_back(-1 + 2*(i/h)/(float)h); //z
-
-		heights[i] = curHeight;
-
-		texBuf.push_back((i%w)/(float)w);
-		texBuf.push_back((i/h)/(float)h);
-	}	
-
-
-	//setup indexed face set
-	for(int x = 0; x < w-1; x++){
-		for(int y = 0; y < h-1; y++){
-			/*
-			* |\
-			* |_\
-			*/
-			//vertices go counterclockwise
-			eleBuf.push_back(y*w + x);
-			eleBuf.push_back((y+1)*w + x);
-			eleBuf.push_back((y+1)*w + x+1);
-
-			/*
-			* ___
-			* \ |
-			*  \|
-			*/
-			//vertices go counterclockwise
-			eleBuf.push_back((y+1)*w + x+1);
-			eleBuf.push_back(y*w + x+1);
-			eleBuf.push_back(y*w + x);
-		}
-	}
-
-	stbi_image_free(data);
-
-	generateNormals();
-}
-
-//get's the height at a given location (between -1 an 1)
-float Terrain::getHeight(float xpos, float ypos)
-{
-	float x = (1+xpos)/2.0 * imgWidth;
-	int x1 = floor(x);
-	if(x1 > imgWidth - 1) x1 = imgWidth - 1;
-	if(x1 < 0) x1 = 0;
-	int x2 = ceil(x);
-	if(x2 > imgWidth - 1) x2 = imgWidth - 1;
-	if(x2 < 0) x2 = 0;
-	float percentX = (x-x1);
-
-	float y = (1+ypos)/2.0 * imgHeight;
-	int y1 = floor(y);
-	if(y1 > imgHeight - 1) y1 = imgHeight - 1;
-	if(y1 < 0) y1 = 0;
-	int y2 = ceil(y);
-	if(y2 > imgHeight - 1) y2 = imgHeight - 1;
-	if(y2 < 0) y2 = 0;
-	float percentY = (y-y1);
-
-	float xh1 = (heights[y1*imgWidth + x1] * (1-percentX)) + (heights[y1*imgWidth + x2] * percentX);
-	float xh2 = (heights[y2*imgWidth + x1] * (1-percentX)) + (heights[y2*imgWidth + x2] * percentX);
-
-	return (xh1 * (1-percentY)) + (xh2 * percentY);
-}
-
-//get the rotation matrix of current face
-glm::vec2 Terrain::getRotation(float xpos, float ypos, glm::vec3 terrainScale)
-{
-	float x = (1+xpos)/2.0 * imgWidth;
-	int x1 = floor(x);
-	if(x1 > imgWidth - 1) x1 = imgWidth - 1;
-	if(x1 < 0) x1 = 0;
-	int x2 = ceil(x);
-	if(x2 > imgWidth - 1) x2 = imgWidth - 1;
-	if(x2 < 0) x2 = 0;
-	float percentX = (x-x1);
-
-	float y = (1+ypos)/2.0 * imgHeight;
-	int y1 = floor(y);
-	if(y1 > imgHeight - 1) y1 = imgHeight - 1;
-	if(y1 < 0) y1 = 0;
-	int y2 = ceil(y);
-	if(y2 > imgHeight - 1) y2 = imgHeight - 1;
-	if(y2 < 0) y2 = 0;
-	float percentY = (y-y1);
-
-	glm::vec3 normal = glm::vec3(0);
-
-	int index = y1*imgWidth + x1;
-	normal += (glm::vec3(norBuf[3*index], norBuf[3*index+1], norBuf[3*index+2]) * (1-percentX) * (1-percentY));
-	index = y1*imgWidth + x2;
-	normal += (glm::vec3(norBuf[3*index], norBuf[3*index+1], norBuf[3*index+2]) * (percentX) * (1-percentY));
-	index = y2*imgWidth + x1;
-	normal += (glm::vec3(norBuf[3*index], norBuf[3*index+1], norBuf[3*index+2]) * (1-percentX) * (percentY));
-	index = y2*imgWidth + x2;
-	normal += (glm::vec3(norBuf[3*index], norBuf[3*index+1], norBuf[3*index+2]) * (percentX) * (percentY));
-
-	normal = glm::vec3(normalTransform * glm::vec4(normal.x, normal.y, normal.z, 0));
-	normal = glm::normalize(normal);
-
-	float xRot = atan(normal.x/normal.y);
-	float zRot = atan(normal.z/normal.y);
-
-	return glm::vec2(xRot, zRot);
-}
-
-void Terrain::setTerrainScale(float x, float y, float z)
-{
-	terrainScaleVec = glm::vec3(x, y, z);
-	normalTransform = glm::transpose(glm::inverse(glm::scale(glm::mat4(1.0f), terrainScaleVec)));
-}
+#include "Terrain.h"
+#include "MatrixStack.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <mutex>
+#include <algorithm>
+#include <cmath>
+#include <climits>
+
+#include "GLSL.h"
+#include "Program.h"
+#include "Frustum.h"
+#include "Parallel.h"
+#include "MeshCache.h"
+#include "MeshOptimizer.h"
+
+#include "stb_image.h"
+
+#define GLM_ENABLE_EXPERIMENTAL
+#include <glm/gtc/type_ptr.hpp>
+#include <glm/gtx/transform.hpp>
+#include <GLFW/glfw3.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define TERRAIN_AVX2
+#include <immintrin.h>
+#endif
+
+
+//held while stb_image decodes, terrains loading on other threads wait for it
+static std::mutex stbLoadMutex;
+
+//a colour pixel's height is its grey level, weighted as before and scaled to [0, 1]
+static const float GreyWeightR = 0.3f/255.0f;
+static const float GreyWeightG = 0.59f/255.0f;
+static const float GreyWeightB = 0.11f/255.0f;
+
+//a raw heightmap sample's height
+static const float RawHeightScale = 1.0f/65535.0f;
+
+//eleBuf offsets and counts are 32 bit, and the grid takes 6 indices per quad
+static bool gridIndicesFit(int width, int height)
+{
+	return (size_t)6*(width - 1)*(height - 1) <= (size_t)UINT_MAX;
+}
+
+#ifdef TERRAIN_AVX2
+/*
+* converts colour pixels of ncomps (3 or 4) bytes to heights 8 at a time, returns how many it did
+* each lane gathers the 4 bytes at its pixel, so the last pixel of an RGB row is left to the scalar loop
+*/
+__attribute__((target("avx2")))
+static int colourToHeightsAvx2(const unsigned char *pixels, int ncomps, int count, float *out)
+{
+	int safe = ncomps == 4 ? count : count - 1;
+	const __m256i offsets = _mm256_mullo_epi32(_mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7), _mm256_set1_epi32(ncomps));
+	const __m256i byteMask = _mm256_set1_epi32(0xFF);
+	const __m256 wr = _mm256_set1_ps(GreyWeightR);
+	const __m256 wg = _mm256_set1_ps(GreyWeightG);
+	const __m256 wb = _mm256_set1_ps(GreyWeightB);
+
+	int done = 0;
+	for(; done + 8 <= safe; done += 8){
+		__m256i px = _mm256_i32gather_epi32((const int *)(pixels + done*ncomps), offsets, 1);
+		__m256 r = _mm256_cvtepi32_ps(_mm256_and_si256(px, byteMask));
+		__m256 g = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 8), byteMask));
+		__m256 b = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(px, 16), byteMask));
+		__m256 height = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, wr), _mm256_mul_ps(g, wg)), _mm256_mul_ps(b, wb));
+		_mm256_storeu_ps(out + done, height);
+	}
+	return done;
+}
+#endif
+
+/* converts count pixels of ncomps bytes to heights between 0 and 1, grey pixels go through a table */
+static void pixelsToHeights(const unsigned char *pixels, int ncomps, int count, bool simd, const float *greyLevels, float *out)
+{
+	if(ncomps < 3){
+		for(int i = 0; i < count; i++){
+			out[i] = greyLevels[pixels[i*ncomps]];
+		}
+		return;
+	}
+
+	int done = 0;
+#ifdef TERRAIN_AVX2
+	if(simd){
+		done = colourToHeightsAvx2(pixels, ncomps, count, out);
+	}
+#endif
+	for(int i = done; i < count; i++){
+		const unsigned char *p = pixels + i*ncomps;
+		out[i] = (p[0]*GreyWeightR + p[1]*GreyWeightG) + p[2]*GreyWeightB;
+	}
+}
+
+//out of line so users of Terrain do not need MappedFile's definition
+Terrain::Terrain()
+{
+}
+
+Terrain::~Terrain()
+{
+}
+
+/* decodes an image heightmap into heights, then builds the grid mesh from them */
+void Terrain::loadImage(const std::string &heightMap)
+{
+    // Load heightmap image
+	//stb_image keeps its settings and errors in globals, so only the decode is done one terrain at a time
+	int w, h, ncomps;
+	unsigned char *data;
+	{
+		std::lock_guard<std::mutex> lock(stbLoadMutex);
+		stbi_set_flip_vertically_on_load(true);
+		data = stbi_load(heightMap.c_str(), &w, &h, &ncomps, 0);
+	}
+	if(! data)
+	{
+		std::cerr << heightMap << " not found" << std::endl;
+		return;
+	}
+	if(ncomps < 1 || ncomps > 4){
+		std::cerr << "Weird number of color components" << std::endl;
+		stbi_image_free(data);
+		return;
+	}
+
+	closeHeightFile();
+	streamedGrid = false;
+	//the rows are first touched by the threads that fill them
+	if(!gridIndicesFit(w, h) || !heights.resize((size_t)w*h)){
+		std::cerr << heightMap << " is too big to load" << std::endl;
+		imgWidth = imgHeight = 0;
+		stbi_image_free(data);
+		return;
+	}
+	imgWidth = w;
+	imgHeight = h;
+
+	//grey levels as the old double precision conversion gave them
+	float greyLevels[256];
+	for(int i = 0; i < 256; i++){
+		greyLevels[i] = i/255.0;
+	}
+	bool simd = false;
+#ifdef TERRAIN_AVX2
+	simd = __builtin_cpu_supports("avx2");
+#endif
+
+	parallelFor(h, threadCount, [&](size_t begin, size_t end, unsigned int thread){
+		for(size_t y = begin; y < end; y++){
+			size_t row = y*w;
+			pixelsToHeights(data + row*ncomps, ncomps, w, simd, greyLevels, heights.data() + row);
+		}
+	});
+	stbi_image_free(data);
+
+	buildGrid();
+
+	generateGridNormals();
+}
+
+/*
+* maps the file and lays out the chunks over it, reading every height once for their bounds
+* the mesh is left to init, which builds it from the mapping and uploads it a row of chunks at a time
+*/
+bool Terrain::loadRawHeightmap(const std::string &path, int width, int height, int tileSize)
+{
+	if(width < 2 || height < 2 || tileSize < 0){
+		std::cerr << path << ": " << width << "x" << height << " heightmap with " << tileSize << " tiles is not a valid size" << std::endl;
+		return false;
+	}
+	//grid vertices are ints, and the chunks' base vertices GLints
+	if((size_t)width*height > (size_t)INT_MAX){
+		std::cerr << path << " is too big to mesh" << std::endl;
+		return false;
+	}
+	size_t samples = (size_t)width*height;
+	if(tileSize > 0){
+		size_t tilesX = (width + tileSize - 1) / tileSize;
+		size_t tilesY = (height + tileSize - 1) / tileSize;
+		samples = tilesX*tilesY*tileSize*tileSize;
+	}
+
+	std::unique_ptr<MappedFile> file(new MappedFile());
+	if(!file->open(path)){
+		std::cerr << path << " not found" << std::endl;
+		return false;
+	}
+	if(file->size() / 2 < samples){
+		std::cerr << path << " is too small for a " << width << "x" << height << " heightmap" << std::endl;
+		return false;
+	}
+
+	closeHeightFile();
+	heights.clear();
+	releaseBuffer(posBuf);
+	releaseBuffer(norBuf);
+	releaseBuffer(texBuf);
+	releaseBuffer(eleBuf);
+	heightFile = std::move(file);
+	heightSamples = heightFile->data();
+	heightTileSize = tileSize;
+	imgWidth = width;
+	imgHeight = height;
+	streamedGrid = true;
+
+	layoutChunks();
+	return true;
+}
+
+/*
+* fills the vertex buffers from the mapping one row of chunks at a time, the rows a row of chunks starts are
+* contiguous in the grid's vertex order, so each goes to the GPU in one piece and only it is ever on the CPU
+*/
+void Terrain::uploadStreamedGrid()
+{
+	glGenVertexArrays(1, &vaoID);
+	glBindVertexArray(vaoID);
+
+	int w = imgWidth;
+	int h = imgHeight;
+	createVertexBuffers((size_t)w*h, true);
+	std::vector<float> pos, nor, tex;
+	for(int y0 = 0; y0 < h; y0 += TerrainChunkQuads){
+		int rows = std::min(TerrainChunkQuads, h - y0);
+		size_t count = (size_t)rows*w;
+		pos.resize(3*count);
+		nor.resize(3*count);
+		tex.resize(2*count);
+		parallelFor(rows, threadCount, [&](size_t begin, size_t end, unsigned int thread){
+			for(size_t r = begin; r < end; r++){
+				int y = y0 + r;
+				for(int x = 0; x < w; x++){
+					size_t i = r*w + x;
+					glm::vec3 p = gridPosition(x, y);
+					glm::vec3 n = gridNormal(x, y);
+					pos[3*i] = p.x;
+					pos[3*i+1] = p.y;
+					pos[3*i+2] = p.z;
+					nor[3*i] = n.x;
+					nor[3*i+1] = n.y;
+					nor[3*i+2] = n.z;
+					tex[2*i] = x/(float)w;
+					tex[2*i+1] = y/(float)h;
+				}
+			}
+		});
+
+		struct MeshStreams streams;
+		streams.vertexCount = count;
+		streams.pos = pos.data();
+		streams.nor = nor.data();
+		streams.tex = tex.data();
+		uploadVertices((size_t)y0*w, streams);
+	}
+	glBindBuffer(GL_ARRAY_BUFFER, 0);
+	elementCount = 0;
+}
+
+/* a mapped raw heightmap is copied into heights, so this terrain does not depend on the other's mapping */
+void Terrain::copyGrid(const Terrain &other)
+{
+	closeHeightFile();
+	streamedGrid = false;
+	if(other.streamedGrid && !gridIndicesFit(other.imgWidth, other.imgHeight)){
+		std::cerr << "the terrain is too big to copy into memory" << std::endl;
+		imgWidth = imgHeight = 0;
+		return;
+	}
+	if(!heights.resize((size_t)other.imgWidth*other.imgHeight)){
+		std::cerr << "not enough memory to copy the terrain's heights" << std::endl;
+		imgWidth = imgHeight = 0;
+		return;
+	}
+	imgWidth = other.imgWidth;
+	imgHeight = other.imgHeight;
+	parallelFor(imgHeight, threadCount, [&](size_t begin, size_t end, unsigned int thread){
+		for(size_t y = begin; y < end; y++){
+			for(int x = 0; x < imgWidth; x++){
+				heights[y*imgWidth + x] = other.heightAt(x, y);
+			}
+		}
+	});
+	terrainScaleVec = other.terrainScaleVec;
+	normalTransform = other.normalTransform;
+
+	//a streamed grid has no mesh on the CPU to copy, so it is built from the copied heights
+	if(other.streamedGrid){
+		buildGrid();
+		generateGridNormals();
+	}
+	else{
+		posBuf = other.posBuf;
+		norBuf = other.norBuf;
+		texBuf = other.texBuf;
+		eleBuf = other.eleBuf;
+	}
+	chunks.clear();
+	nodes.clear();
+	chunkGrid.clear();
+	gridWidth = 0;
+	chunksX = chunksY = 0;
+}
+
+void Terrain::closeHeightFile()
+{
+	heightFile.reset();
+	heightSamples = NULL;
+	heightTileSize = 0;
+}
+
+/* the height of grid vertex (x, y), from heights or a mapped raw heightmap */
+float Terrain::heightAt(int x, int y) const
+{
+	if(heightSamples == NULL){
+		return heights[(size_t)y*imgWidth + x];
+	}
+
+	//the file's rows run from the top and the grid's from the bottom
+	size_t row = imgHeight - 1 - y;
+	size_t sample;
+	if(heightTileSize == 0){
+		sample = row*imgWidth + x;
+	}
+	else{
+		size_t tilesX = (imgWidth + heightTileSize - 1) / heightTileSize;
+		size_t tile = (row / heightTileSize) * tilesX + x / heightTileSize;
+		sample = (tile*heightTileSize + row % heightTileSize) * heightTileSize + x % heightTileSize;
+	}
+	const unsigned char *bytes = heightSamples + 2*sample;
+	return (bytes[0] | bytes[1] << 8) * RawHeightScale;
+}
+
+/*
+* every buffer is sized up front, then vertices are filled in parallel over rows
+* and triangles in parallel over chunks, each chunk writing its own range of eleBuf
+*/
+void Terrain::buildGrid()
+{
+	int w = imgWidth;
+	int h = imgHeight;
+	posBuf.resize(3*(size_t)w*h);
+	texBuf.resize(2*(size_t)w*h);
+	parallelFor(h, threadCount, [&](size_t begin, size_t end, unsigned int thread){
+		for(size_t y = begin; y < end; y++){
+			size_t row = y*w;
+			for(int x = 0; x < w; x++){
+				size_t i = row + x;
+				glm::vec3 p = gridPosition(x, y);
+				posBuf[3*i] = p.x;
+				posBuf[3*i+1] = p.y;
+				posBuf[3*i+2] = p.z;
+
+				texBuf[2*i] = x/(float)w;
+				texBuf[2*i+1] = y/(float)h;
+			}
+		}
+	});
+
+	//setup indexed face set, one chunk at a time in quadtree order
+	unsigned int indexCount = layoutChunks();
+	eleBuf.clear();
+	eleBuf.resize(indexCount);
+	parallelFor(chunks.size(), threadCount, [this](size_t begin, size_t end, unsigned int thread){
+		for(size_t c = begin; c < end; c++){
+			buildChunk(chunks[c]);
+		}
+	});
+}
+
+/*
+* lays out the chunks and the quadtree over the grid and finds their bounds from the heights
+* returns how many indices the chunks' triangles take in eleBuf, none for a streamed grid
+*/
+unsigned int Terrain::layoutChunks()
+{
+	int w = imgWidth;
+	int h = imgHeight;
+	chunks.clear();
+	nodes.clear();
+	gridWidth = w;
+	chunksX = (w - 1 + TerrainChunkQuads - 1) / TerrainChunkQuads;
+	chunksY = (h - 1 + TerrainChunkQuads - 1) / TerrainChunkQuads;
+	unsigned int indexCount = 0;
+	buildNode(w, 0, 0, w-1, h-1, indexCount);
+	parallelFor(chunks.size(), threadCount, [this](size_t begin, size_t end, unsigned int thread){
+		for(size_t c = begin; c < end; c++){
+			chunkBounds(chunks[c]);
+		}
+	});
+
+	//children come after their parent, so walking back merges every child's box before its parent's
+	for(int n = nodes.size() - 1; n >= 0; n--){
+		struct TerrainNode &node = nodes[n];
+		if(node.chunk >= 0){
+			node.min = chunks[node.chunk].min;
+			node.max = chunks[node.chunk].max;
+			continue;
+		}
+		bool first = true;
+		for(int i = 0; i < 4; i++){
+			if(node.children[i] >= 0){
+				const struct TerrainNode &child = nodes[node.children[i]];
+				node.min = first ? child.min : glm::min(node.min, child.min);
+				node.max = first ? child.max : glm::max(node.max, child.max);
+				first = false;
+			}
+		}
+	}
+	chunkGrid.assign(chunksX * chunksY, -1);
+	for(unsigned int i = 0; i < chunks.size(); i++){
+		chunkGrid[chunks[i].gridY * chunksX + chunks[i].gridX] = i;
+	}
+	return indexCount;
+}
+
+/*
+* lays out the quadtree node covering quads [x0, x1) x [y0, y1) and the range of eleBuf under it
+* ranges no bigger than a chunk become leaves, others split on a chunk boundary
+* indexCount is where the node's triangles start and is moved past them, buildChunk fills them in later
+* returns the node's index
+*/
+int Terrain::buildNode(int w, int x0, int y0, int x1, int y1, unsigned int &indexCount)
+{
+	int index = nodes.size();
+	nodes.push_back(TerrainNode());
+	struct TerrainNode node;
+	node.indexOffset = indexCount;
+	node.chunk = -1;
+	for(int i = 0; i < 4; i++){
+		node.children[i] = -1;
+	}
+
+	if(x1 - x0 <= TerrainChunkQuads && y1 - y0 <= TerrainChunkQuads){
+		struct TerrainChunk chunk;
+		chunk.indexOffset = indexCount;
+		chunk.indexCount = streamedGrid ? 0 : 6 * (x1 - x0) * (y1 - y0);
+		indexCount += chunk.indexCount;
+		chunk.baseVertex = y0*w + x0;
+		chunk.quadsX = x1 - x0;
+		chunk.quadsY = y1 - y0;
+		chunk.gridX = x0 / TerrainChunkQuads;
+		chunk.gridY = y0 / TerrainChunkQuads;
+		chunk.maxLevel = 0;
+		while(chunk.maxLevel < TerrainMaxLod && chunk.quadsX % (2 << chunk.maxLevel) == 0 && chunk.quadsY % (2 << chunk.maxLevel) == 0){
+			chunk.maxLevel++;
+		}
+		chunk.patternBlock = 0;
+
+		node.chunk = chunks.size();
+		chunks.push_back(chunk);
+	}
+	else{
+		//split at the middle, rounded to a whole number of chunks
+		int chunksX = (x1 - x0 + TerrainChunkQuads - 1) / TerrainChunkQuads;
+		int chunksY = (y1 - y0 + TerrainChunkQuads - 1) / TerrainChunkQuads;
+		int midX = x0 + (chunksX + 1)/2 * TerrainChunkQuads;
+		int midY = y0 + (chunksY + 1)/2 * TerrainChunkQuads;
+		if(midX > x1) midX = x1;
+		if(midY > y1) midY = y1;
+
+		int ranges[4][4] = {
+			{x0, y0, midX, midY},
+			{midX, y0, x1, midY},
+			{x0, midY, midX, y1},
+			{midX, midY, x1, y1}};
+		for(int i = 0; i < 4; i++){
+			if(ranges[i][2] <= ranges[i][0] || ranges[i][3] <= ranges[i][1]){
+				continue;
+			}
+			node.children[i] = buildNode(w, ranges[i][0], ranges[i][1], ranges[i][2], ranges[i][3], indexCount);
+		}
+	}
+
+	node.indexCount = indexCount - node.indexOffset;
+	nodes[index] = node;
+	return index;
+}
+
+/* a chunk's bounding box, from the heights so a streamed grid needs no vertices for it */
+void Terrain::chunkBounds(struct TerrainChunk &chunk) const
+{
+	int x0 = chunk.baseVertex % gridWidth;
+	int y0 = chunk.baseVertex / gridWidth;
+	chunk.min = gridPosition(x0, y0);
+	chunk.max = chunk.min;
+	for(int y = y0; y <= y0 + chunk.quadsY; y++){
+		for(int x = x0; x <= x0 + chunk.quadsX; x++){
+			glm::vec3 p = gridPosition(x, y);
+			chunk.min = glm::min(chunk.min, p);
+			chunk.max = glm::max(chunk.max, p);
+		}
+	}
+}
+
+/* writes a chunk's triangles into its range of eleBuf */
+void Terrain::buildChunk(struct TerrainChunk &chunk)
+{
+	int w = gridWidth;
+	int x0 = chunk.baseVertex % w;
+	int y0 = chunk.baseVertex / w;
+	int x1 = x0 + chunk.quadsX;
+	int y1 = y0 + chunk.quadsY;
+
+	unsigned int *out = &eleBuf[chunk.indexOffset];
+	for(int x = x0; x < x1; x++){
+		for(int y = y0; y < y1; y++){
+			/*
+			* |\
+			* |_\
+			*/
+			//vertices go counterclockwise
+			*out++ = y*w + x;
+			*out++ = (y+1)*w + x;
+			*out++ = (y+1)*w + x+1;
+
+			/*
+			* ___
+			* \ |
+			*  \|
+			*/
+			//vertices go counterclockwise
+			*out++ = (y+1)*w + x+1;
+			*out++ = y*w + x+1;
+			*out++ = y*w + x;
+		}
+	}
+}
+
+/*
+* reorders count indices into a quadsX by quadsY block of a grid gridWidth vertices wide, whose first corner is base,
+* for the vertex cache, local is scratch space for the block's own vertex numbering
+*/
+static void optimizeGridBlock(unsigned int *indices, unsigned int count, unsigned int base, int quadsX, int quadsY, int gridWidth, std::vector<unsigned int> &local)
+{
+	unsigned int columns = quadsX + 1;
+	local.resize(count);
+	for(unsigned int k = 0; k < count; k++){
+		unsigned int v = indices[k] - base;
+		local[k] = (v / gridWidth) * columns + v % gridWidth;
+	}
+	optimizeVertexCache(local, columns * (quadsY + 1));
+	for(unsigned int k = 0; k < count; k++){
+		indices[k] = base + (local[k] / columns) * gridWidth + local[k] % columns;
+	}
+}
+
+/*
+* chunks draw their range of eleBuf and LOD patterns address the grid relative to a chunk's corner,
+* so only the triangles within each chunk are reordered and the vertices keep their grid order
+*/
+void Terrain::optimizeMesh()
+{
+	if(usingVoronoi){
+		Shape::optimizeMesh();
+		return;
+	}
+	if(streamedGrid){
+		//there are no chunk triangles, a streamed grid is drawn from the LOD patterns init reorders
+		lodCacheOptimized = true;
+		return;
+	}
+
+	float before = averageCacheMissRatio(eleBuf, VertexCacheSize);
+	parallelFor(chunks.size(), threadCount, [this](size_t begin, size_t end, unsigned int thread){
+		std::vector<unsigned int> local;
+		for(size_t c = begin; c < end; c++){
+			const struct TerrainChunk &chunk = chunks[c];
+			optimizeGridBlock(&eleBuf[chunk.indexOffset], chunk.indexCount, chunk.baseVertex, chunk.quadsX, chunk.quadsY, gridWidth, local);
+		}
+	});
+	float after = averageCacheMissRatio(eleBuf, VertexCacheSize);
+	std::cout << "Terrain vertex cache ACMR (" << VertexCacheSize << " entry FIFO): " << before << " before, " << after << " after optimizing" << std::endl;
+	lodCacheOptimized = true;
+}
+
+/* adds the visible chunks under node to visibleChunks */
+void Terrain::cullNode(int node, const struct Frustum &frustum) const
+{
+	const struct TerrainNode &n = nodes[node];
+	if(!frustum.intersectsBox(n.min, n.max)){
+		return;
+	}
+
+	if(n.chunk < 0){
+		for(int i = 0; i < 4; i++){
+			if(n.children[i] >= 0){
+				cullNode(n.children[i], frustum);
+			}
+		}
+		return;
+	}
+
+	visibleChunks.push_back(n.chunk);
+}
+
+void Terrain::init()
+{
+	if(streamedGrid){
+		uploadStreamedGrid();
+	}
+	else{
+		upload();
+	}
+	if(!usingVoronoi && !chunks.empty()){
+		buildLodPatterns();
+	}
+	visibleChunks.reserve(chunks.size());
+	drawRanges.reserve(chunks.size());
+	chunkLevels.resize(chunks.size());
+	lodCounts.reserve(chunks.size());
+	lodOffsets.reserve(chunks.size());
+	lodBaseVertices.reserve(chunks.size());
+	applyResidency();
+}
+
+size_t Terrain::cpuMeshBytes() const
+{
+	size_t bytes = Shape::cpuMeshBytes();
+	//a mapped raw heightmap is page cache the OS can reclaim, so it is not counted
+	bytes += heights.size() * sizeof(float);
+	bytes += bufferBytes(chunks) + bufferBytes(nodes) + bufferBytes(chunkGrid) + bufferBytes(lodEleBuf) + bufferBytes(lodPatterns);
+	return bytes;
+}
+
+/* the LOD patterns are on the GPU by now, the chunks and quadtree stay for culling */
+void Terrain::releaseCpuMesh()
+{
+	Shape::releaseCpuMesh();
+	releaseBuffer(lodEleBuf);
+	if(residency == MESH_DROP_ALL){
+		heights.clear();
+		closeHeightFile();
+	}
+}
+
+/*
+* builds the triangles of every level of detail and edge mask selectLevels can pick for each chunk size and sends them to the GPU
+* patterns index the grid relative to a chunk's first corner, so every chunk of a size shares them
+*/
+void Terrain::buildLodPatterns()
+{
+	lodEleBuf.clear();
+	lodPatterns.clear();
+	std::vector<unsigned int> blockOwners; //the first chunk of each size
+	const int offsets[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+	for(unsigned int i = 0; i < chunks.size(); i++){
+		struct TerrainChunk &chunk = chunks[i];
+		//chunks of a size already seen reuse that block
+		bool found = false;
+		for(unsigned int j = 0; j < i && !found; j++){
+			if(chunks[j].quadsX == chunk.quadsX && chunks[j].quadsY == chunk.quadsY){
+				chunk.patternBlock = chunks[j].patternBlock;
+				found = true;
+			}
+		}
+		if(found){
+			continue;
+		}
+
+		//an edge is only stitched to a neighbour one level coarser, so it needs a neighbour that can go that coarse
+		//chunks in a row or column share their height or width, so such a neighbour also fits the stitched edge
+		int neighbourLevels[4] = {-1, -1, -1, -1};
+		for(const struct TerrainChunk &other : chunks){
+			if(other.quadsX != chunk.quadsX || other.quadsY != chunk.quadsY){
+				continue;
+			}
+			for(int side = 0; side < 4; side++){
+				int gx = other.gridX + offsets[side][0];
+				int gy = other.gridY + offsets[side][1];
+				if(gx >= 0 && gy >= 0 && gx < chunksX && gy < chunksY){
+					neighbourLevels[side] = std::max(neighbourLevels[side], chunks[chunkGrid[gy * chunksX + gx]].maxLevel);
+				}
+			}
+		}
+
+		chunk.patternBlock = lodPatterns.size();
+		for(int level = 0; level <= chunk.maxLevel; level++){
+			for(int mask = 0; mask < 16; mask++){
+				bool reachable = true;
+				for(int side = 0; side < 4; side++){
+					reachable = reachable && (!(mask & (1 << side)) || level + 1 <= neighbourLevels[side]);
+				}
+				if(reachable){
+					buildLodPattern(chunk.quadsX, chunk.quadsY, level, mask);
+				}
+				else{
+					//selectLevels never picks it, it only keeps the block's layout
+					struct TerrainLodPattern empty;
+					empty.indexOffset = lodEleBuf.size();
+					empty.indexCount = 0;
+					lodPatterns.push_back(empty);
+				}
+			}
+		}
+		blockOwners.push_back(i);
+	}
+
+	if(lodCacheOptimized){
+		float before = averageCacheMissRatio(lodEleBuf, VertexCacheSize);
+		std::vector<unsigned int> local;
+		for(unsigned int owner : blockOwners){
+			const struct TerrainChunk &chunk = chunks[owner];
+			unsigned int last = chunk.patternBlock + 16*(chunk.maxLevel + 1);
+			for(unsigned int p = chunk.patternBlock; p < last; p++){
+				const struct TerrainLodPattern &pattern = lodPatterns[p];
+				optimizeGridBlock(&lodEleBuf[pattern.indexOffset], pattern.indexCount, 0, chunk.quadsX, chunk.quadsY, gridWidth, local);
+			}
+		}
+		float after = averageCacheMissRatio(lodEleBuf, VertexCacheSize);
+		std::cout << "Terrain LOD pattern ACMR (" << VertexCacheSize << " entry FIFO): " << before << " before, " << after << " after optimizing" << std::endl;
+	}
+
+	unsigned int maxIndex = TerrainChunkQuads * gridWidth + TerrainChunkQuads;
+	lodShortIndices = maxIndex <= 0xFFFF;
+	glGenBuffers(1, &lodEleBufID);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lodEleBufID);
+	if(lodShortIndices){
+		std::vector<unsigned short> shortIndices(lodEleBuf.begin(), lodEleBuf.end());
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, shortIndices.size()*sizeof(unsigned short), &shortIndices[0], GL_STATIC_DRAW);
+	}
+	else{
+		glBufferData(GL_ELEMENT_ARRAY_BUFFER, lodEleBuf.size()*sizeof(unsigned int), &lodEleBuf[0], GL_STATIC_DRAW);
+	}
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+/*
+* triangulates a chunk at every 2^level quads, in the same pattern as the full detail grid
+* on edges in mask (bit 0 low y, 1 high x, 2 high y, 3 low x) the vertices the coarser neighbour does not have
+* are moved onto the one before them, so the edge matches the neighbour and no cracks open
+* triangles that collapse are dropped
+*/
+void Terrain::buildLodPattern(int quadsX, int quadsY, int level, int mask)
+{
+	int step = 1 << level;
+	struct TerrainLodPattern pattern;
+	pattern.indexOffset = lodEleBuf.size();
+
+	for(int x = 0; x < quadsX; x += step){
+		for(int y = 0; y < quadsY; y += step){
+			int corners[6][2] = {
+				{x, y}, {x, y+step}, {x+step, y+step},
+				{x+step, y+step}, {x+step, y}, {x, y}};
+			unsigned int tri[6];
+			for(int k = 0; k < 6; k++){
+				int cx = corners[k][0];
+				int cy = corners[k][1];
+				if((mask & 1) && cy == 0 && (cx / step) % 2 == 1) cx -= step;
+				if((mask & 4) && cy == quadsY && (cx / step) % 2 == 1) cx -= step;
+				if((mask & 8) && cx == 0 && (cy / step) % 2 == 1) cy -= step;
+				if((mask & 2) && cx == quadsX && (cy / step) % 2 == 1) cy -= step;
+				tri[k] = cy * gridWidth + cx;
+			}
+			for(int t = 0; t < 6; t += 3){
+				if(tri[t] != tri[t+1] && tri[t+1] != tri[t+2] && tri[t] != tri[t+2]){
+					lodEleBuf.insert(lodEleBuf.end(), tri + t, tri + t + 3);
+				}
+			}
+		}
+	}
+
+	pattern.indexCount = lodEleBuf.size() - pattern.indexOffset;
+	lodPatterns.push_back(pattern);
+}
+
+/*
+* picks every chunk's level from its distance to the eye, then lowers levels until
+* no chunk is more than one level coarser than a neighbour, which the stitched edges need
+*/
+void Terrain::selectLevels() const
+{
+	for(unsigned int i = 0; i < chunks.size(); i++){
+		const struct TerrainChunk &chunk = chunks[i];
+		glm::vec3 center = (chunk.min + chunk.max) * 0.5f;
+		glm::vec3 half = (chunk.max - chunk.min) * 0.5f;
+		glm::vec3 worldCenter = glm::vec3(lodModel * glm::vec4(center, 1.0f));
+		float radius = glm::length(glm::vec3(lodModel * glm::vec4(half, 0.0f)));
+		float dist = glm::length(worldCenter - lodEye) - radius;
+
+		int level = 0;
+		float range = lodDistance * 2.0f * radius;
+		while(level < chunk.maxLevel && dist > range){
+			level++;
+			range *= 2.0f;
+		}
+		chunkLevels[i] = level;
+	}
+
+	const int offsets[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+	bool changed = true;
+	while(changed){
+		changed = false;
+		for(unsigned int i = 0; i < chunks.size(); i++){
+			for(int side = 0; side < 4; side++){
+				int gx = chunks[i].gridX + offsets[side][0];
+				int gy = chunks[i].gridY + offsets[side][1];
+				if(gx < 0 || gy < 0 || gx >= chunksX || gy >= chunksY){
+					continue;
+				}
+				int neighbour = chunkGrid[gy * chunksX + gx];
+				if(chunkLevels[i] > chunkLevels[neighbour] + 1){
+					chunkLevels[i] = chunkLevels[neighbour] + 1;
+					changed = true;
+				}
+			}
+		}
+	}
+}
+
+/*
+* draws the visible chunks at their level of detail with one call, each relative to its own first corner
+* without LOD every chunk is at level 0, which is how a streamed grid is drawn at full detail
+*/
+void Terrain::drawLod() const
+{
+	if(lodEnabled){
+		selectLevels();
+	}
+	else{
+		std::fill(chunkLevels.begin(), chunkLevels.end(), 0);
+	}
+
+	const int offsets[4][2] = {{0, -1}, {1, 0}, {0, 1}, {-1, 0}};
+	size_t indexSize = lodShortIndices ? sizeof(unsigned short) : sizeof(unsigned int);
+	lodCounts.clear();
+	lodOffsets.clear();
+	lodBaseVertices.clear();
+	for(int c : visibleChunks){
+		const struct TerrainChunk &chunk = chunks[c];
+		int level = chunkLevels[c];
+		int mask = 0;
+		for(int side = 0; side < 4; side++){
+			int gx = chunk.gridX + offsets[side][0];
+			int gy = chunk.gridY + offsets[side][1];
+			if(gx >= 0 && gy >= 0 && gx < chunksX && gy < chunksY && chunkLevels[chunkGrid[gy * chunksX + gx]] > level){
+				mask |= 1 << side;
+			}
+		}
+
+		const struct TerrainLodPattern &pattern = lodPatterns[chunk.patternBlock + level*16 + mask];
+		lodCounts.push_back(pattern.indexCount);
+		lodOffsets.push_back((const void *)(indexSize * pattern.indexOffset));
+		lodBaseVertices.push_back(chunk.baseVertex);
+		trianglesDrawn += pattern.indexCount/3;
+	}
+
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, lodEleBufID);
+	if(!lodCounts.empty()){
+		glMultiDrawElementsBaseVertex(GL_TRIANGLES, &lodCounts[0], lodShortIndices ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT,
+			&lodOffsets[0], lodCounts.size(), &lodBaseVertices[0]);
+	}
+	drawCallCount = 1;
+}
+
+void Terrain::draw(const std::shared_ptr<Program> prog) const
+{
+	if(usingVoronoi || nodes.empty()){
+		Shape::draw(prog);
+		chunksDrawn = chunks.size();
+		trianglesDrawn = elementCount/3;
+		return;
+	}
+
+	//find the visible chunks, everything is drawn until a cull matrix is set
+	visibleChunks.clear();
+	if(cullingEnabled){
+		struct Frustum frustum;
+		frustum.extract(cullMatrix);
+		cullNode(0, frustum);
+	}
+	else{
+		for(unsigned int i = 0; i < chunks.size(); i++){
+			visibleChunks.push_back(i);
+		}
+	}
+	chunksDrawn = visibleChunks.size();
+	trianglesDrawn = 0;
+
+	int h_pos, h_nor, h_tex, h_cell;
+	const struct ShapeDrawHandles &h = drawHandles(*prog);
+
+	glBindVertexArray(vaoID);
+	bindVertexAttributes(*prog, h, h_pos, h_nor, h_tex, h_cell);
+
+	glm::mat4 S(1.0f);
+	glUniformMatrix4fv(prog->getUniform(h.S), 1, GL_FALSE, glm::value_ptr(S));
+	//a streamed grid has no eleBuf, so it always draws the patterns
+	if((lodEnabled || streamedGrid) && lodEleBufID != 0){
+		drawLod();
+	}
+	else{
+		//chunks are in eleBuf in tree order, so neighbouring visible chunks join into one range
+		drawRanges.clear();
+		for(int c : visibleChunks){
+			const struct TerrainChunk &chunk = chunks[c];
+			trianglesDrawn += chunk.indexCount/3;
+			if(!drawRanges.empty() && drawRanges.back().first + drawRanges.back().second == chunk.indexOffset){
+				drawRanges.back().second += chunk.indexCount;
+			}
+			else{
+				drawRanges.push_back(std::make_pair(chunk.indexOffset, chunk.indexCount));
+			}
+		}
+
+		glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, eleBufID);
+		for(const std::pair<unsigned int, unsigned int> &range : drawRanges){
+			glDrawElements(GL_TRIANGLES, range.second, GL_UNSIGNED_INT, (const void *)(sizeof(unsigned int) * range.first));
+		}
+		drawCallCount = drawRanges.size();
+	}
+
+	unbindVertexAttributes(h_pos, h_nor, h_tex, h_cell);
+	glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+//grid corners around a query and how far across the cell it is, clamped to the grid
+struct GridSample
+{
+	int x1, x2, y1, y2;
+	float percentX, percentY;
+};
+
+/* the scalar version of what the AVX2 batch does, with the same float operations so both give the same heights */
+static struct GridSample gridSample(float xpos, float ypos, int width, int height)
+{
+	struct GridSample sample;
+	float x = (1 + xpos) * 0.5f * width;
+	float x1 = fminf(fmaxf(floorf(x), 0.0f), width - 1);
+	float x2 = fminf(fmaxf(ceilf(x), 0.0f), width - 1);
+	float y = (1 + ypos) * 0.5f * height;
+	float y1 = fminf(fmaxf(floorf(y), 0.0f), height - 1);
+	float y2 = fminf(fmaxf(ceilf(y), 0.0f), height - 1);
+	sample.x1 = (int)x1;
+	sample.x2 = (int)x2;
+	sample.y1 = (int)y1;
+	sample.y2 = (int)y2;
+	sample.percentX = x - x1;
+	sample.percentY = y - y1;
+	return sample;
+}
+
+//get's the height at a given location (between -1 an 1)
+float Terrain::getHeight(float xpos, float ypos) const
+{
+	if(!hasHeights()){
+		std::cerr << "terrain has no heights, none were loaded or MESH_DROP_ALL released them" << std::endl;
+		return 0;
+	}
+	return sampleHeight(xpos, ypos);
+}
+
+float Terrain::sampleHeight(float xpos, float ypos) const
+{
+	struct GridSample s = gridSample(xpos, ypos, imgWidth, imgHeight);
+	float xh1 = (heightAt(s.x1, s.y1) * (1-s.percentX)) + (heightAt(s.x2, s.y1) * s.percentX);
+	float xh2 = (heightAt(s.x1, s.y2) * (1-s.percentX)) + (heightAt(s.x2, s.y2) * s.percentX);
+	return (xh1 * (1-s.percentY)) + (xh2 * s.percentY);
+}
+
+/* the grid normals around a location blended bilinearly, then scaled by the terrain scale */
+glm::vec3 Terrain::sampleNormal(float xpos, float ypos) const
+{
+	struct GridSample s = gridSample(xpos, ypos, imgWidth, imgHeight);
+	glm::vec3 normal = glm::vec3(0);
+	normal += gridNormal(s.x1, s.y1) * ((1-s.percentX) * (1-s.percentY));
+	normal += gridNormal(s.x2, s.y1) * (s.percentX * (1-s.percentY));
+	normal += gridNormal(s.x1, s.y2) * ((1-s.percentX) * s.percentY);
+	normal += gridNormal(s.x2, s.y2) * (s.percentX * s.percentY);
+
+	normal = glm::vec3(normalTransform * glm::vec4(normal.x, normal.y, normal.z, 0));
+	return glm::normalize(normal);
+}
+
+//get the rotation matrix of current face
+glm::vec2 Terrain::getRotation(float xpos, float ypos, glm::vec3 terrainScale) const
+{
+	if(!hasHeights()){
+		std::cerr << "terrain has no heights, none were loaded or MESH_DROP_ALL released them" << std::endl;
+		return glm::vec2(0);
+	}
+
+	glm::vec3 normal = sampleNormal(xpos, ypos);
+	float xRot = atan(normal.x/normal.y);
+	float zRot = atan(normal.z/normal.y);
+
+	return glm::vec2(xRot, zRot);
+}
+
+#ifdef TERRAIN_AVX2
+
+//8 queries' grid corners and blend weights, laid out like GridSample
+struct GridSample8
+{
+	__m256i x1, x2, y1, y2;
+	__m256 percentX, percentY;
+};
+
+__attribute__((target("avx2")))
+static inline struct GridSample8 gridSample8(const float *xpos, const float *ypos, int width, int height)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256 half = _mm256_set1_ps(0.5f);
+	const __m256 zero = _mm256_setzero_ps();
+	const __m256 maxX = _mm256_set1_ps(width - 1);
+	const __m256 maxY = _mm256_set1_ps(height - 1);
+
+	struct GridSample8 sample;
+	__m256 x = _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(one, _mm256_loadu_ps(xpos)), half), _mm256_set1_ps(width));
+	__m256 x1 = _mm256_min_ps(_mm256_max_ps(_mm256_floor_ps(x), zero), maxX);
+	__m256 x2 = _mm256_min_ps(_mm256_max_ps(_mm256_ceil_ps(x), zero), maxX);
+	__m256 y = _mm256_mul_ps(_mm256_mul_ps(_mm256_add_ps(one, _mm256_loadu_ps(ypos)), half), _mm256_set1_ps(height));
+	__m256 y1 = _mm256_min_ps(_mm256_max_ps(_mm256_floor_ps(y), zero), maxY);
+	__m256 y2 = _mm256_min_ps(_mm256_max_ps(_mm256_ceil_ps(y), zero), maxY);
+	sample.x1 = _mm256_cvttps_epi32(x1);
+	sample.x2 = _mm256_cvttps_epi32(x2);
+	sample.y1 = _mm256_cvttps_epi32(y1);
+	sample.y2 = _mm256_cvttps_epi32(y2);
+	sample.percentX = _mm256_sub_ps(x, x1);
+	sample.percentY = _mm256_sub_ps(y, y1);
+	return sample;
+}
+
+__attribute__((target("avx2")))
+static inline __m256 gatherHeight(const float *heights, __m256i x, __m256i y, __m256i width)
+{
+	return _mm256_i32gather_ps(heights, _mm256_add_epi32(_mm256_mullo_epi32(y, width), x), 4);
+}
+
+/* bilinear heights of 8 queries at a time, returns how many were done */
+__attribute__((target("avx2")))
+static size_t sampleHeightsAvx2(const float *heights, int width, int height, const float *xpos, const float *ypos, size_t count, float *out)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	const __m256i w = _mm256_set1_epi32(width);
+	size_t done = 0;
+	for(; done + 8 <= count; done += 8){
+		struct GridSample8 s = gridSample8(xpos + done, ypos + done, width, height);
+		__m256 invX = _mm256_sub_ps(one, s.percentX);
+		__m256 xh1 = _mm256_add_ps(_mm256_mul_ps(gatherHeight(heights, s.x1, s.y1, w), invX), _mm256_mul_ps(gatherHeight(heights, s.x2, s.y1, w), s.percentX));
+		__m256 xh2 = _mm256_add_ps(_mm256_mul_ps(gatherHeight(heights, s.x1, s.y2, w), invX), _mm256_mul_ps(gatherHeight(heights, s.x2, s.y2, w), s.percentX));
+		__m256 result = _mm256_add_ps(_mm256_mul_ps(xh1, _mm256_sub_ps(one, s.percentY)), _mm256_mul_ps(xh2, s.percentY));
+		_mm256_storeu_ps(out + done, result);
+	}
+	return done;
+}
+
+/* Terrain::gridNormal for 8 grid vertices, unnormalized components are returned through nx, ny, nz */
+__attribute__((target("avx2")))
+static inline void gridNormal8(const float *heights, int width, int height, __m256i x, __m256i y, __m256 &nx, __m256 &ny, __m256 &nz)
+{
+	const __m256i w = _mm256_set1_epi32(width);
+	const __m256i one = _mm256_set1_epi32(1);
+	const __m256i zero = _mm256_setzero_si256();
+	const __m256 two = _mm256_set1_ps(2.0f);
+	__m256i left = _mm256_max_epi32(_mm256_sub_epi32(x, one), zero);
+	__m256i right = _mm256_min_epi32(_mm256_add_epi32(x, one), _mm256_set1_epi32(width - 1));
+	__m256i down = _mm256_max_epi32(_mm256_sub_epi32(y, one), zero);
+	__m256i up = _mm256_min_epi32(_mm256_add_epi32(y, one), _mm256_set1_epi32(height - 1));
+
+	__m256 spanX = _mm256_div_ps(_mm256_mul_ps(two, _mm256_cvtepi32_ps(_mm256_sub_epi32(right, left))), _mm256_set1_ps(width));
+	__m256 spanZ = _mm256_div_ps(_mm256_mul_ps(two, _mm256_cvtepi32_ps(_mm256_sub_epi32(up, down))), _mm256_set1_ps(height));
+	__m256 riseX = _mm256_sub_ps(gatherHeight(heights, right, y, w), gatherHeight(heights, left, y, w));
+	__m256 riseZ = _mm256_sub_ps(gatherHeight(heights, x, up, w), gatherHeight(heights, x, down, w));
+
+	const __m256 signMask = _mm256_set1_ps(-0.0f);
+	nx = _mm256_xor_ps(_mm256_mul_ps(spanZ, riseX), signMask);
+	ny = _mm256_mul_ps(spanX, spanZ);
+	nz = _mm256_xor_ps(_mm256_mul_ps(spanX, riseZ), signMask);
+	__m256 invLength = _mm256_div_ps(_mm256_set1_ps(1.0f), _mm256_sqrt_ps(
+		_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(nx, nx), _mm256_mul_ps(ny, ny)), _mm256_mul_ps(nz, nz))));
+	nx = _mm256_mul_ps(nx, invLength);
+	ny = _mm256_mul_ps(ny, invLength);
+	nz = _mm256_mul_ps(nz, invLength);
+}
+
+/* Terrain::sampleNormal for 8 queries at a time, transform is the upper 3x3 of the normal transform, returns how many were done */
+__attribute__((target("avx2")))
+static size_t sampleNormalsAvx2(const float *heights, int width, int height, const glm::mat4 &transform,
+	const float *xpos, const float *ypos, size_t count, glm::vec3 *out)
+{
+	const __m256 one = _mm256_set1_ps(1.0f);
+	size_t done = 0;
+	for(; done + 8 <= count; done += 8){
+		struct GridSample8 s = gridSample8(xpos + done, ypos + done, width, height);
+		__m256 invX = _mm256_sub_ps(one, s.percentX);
+		__m256 invY = _mm256_sub_ps(one, s.percentY);
+		__m256i cornerX[4] = {s.x1, s.x2, s.x1, s.x2};
+		__m256i cornerY[4] = {s.y1, s.y1, s.y2, s.y2};
+		__m256 weight[4] = {
+			_mm256_mul_ps(invX, invY), _mm256_mul_ps(s.percentX, invY),
+			_mm256_mul_ps(invX, s.percentY), _mm256_mul_ps(s.percentX, s.percentY)};
+
+		__m256 sumX = _mm256_setzero_ps(), sumY = _mm256_setzero_ps(), sumZ = _mm256_setzero_ps();
+		for(int c = 0; c < 4; c++){
+			__m256 nx, ny, nz;
+			gridNormal8(heights, width, height, cornerX[c], cornerY[c], nx, ny, nz);
+			sumX = _mm256_add_ps(sumX, _mm256_mul_ps(nx, weight[c]));
+			sumY = _mm256_add_ps(sumY, _mm256_mul_ps(ny, weight[c]));
+			sumZ = _mm256_add_ps(sumZ, _mm256_mul_ps(nz, weight[c]));
+		}
+
+		//column major, so row r of the result is transform[0][r]*x + transform[1][r]*y + transform[2][r]*z
+		__m256 n[3];
+		for(int r = 0; r < 3; r++){
+			n[r] = _mm256_add_ps(_mm256_add_ps(
+				_mm256_mul_ps(_mm256_set1_ps(transform[0][r]), sumX),
+				_mm256_mul_ps(_mm256_set1_ps(transform[1][r]), sumY)),
+				_mm256_mul_ps(_mm256_set1_ps(transform[2][r]), sumZ));
+		}
+		__m256 invLength = _mm256_div_ps(one, _mm256_sqrt_ps(
+			_mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(n[0], n[0]), _mm256_mul_ps(n[1], n[1])), _mm256_mul_ps(n[2], n[2]))));
+
+		float components[3][8];
+		for(int r = 0; r < 3; r++){
+			_mm256_storeu_ps(components[r], _mm256_mul_ps(n[r], invLength));
+		}
+		for(int i = 0; i < 8; i++){
+			out[done + i] = glm::vec3(components[0][i], components[1][i], components[2][i]);
+		}
+	}
+	return done;
+}
+
+#endif
+
+/* getHeight for count locations at once, 8 at a time with AVX2 when the CPU has it */
+void Terrain::getHeights(const float *xpos, const float *ypos, size_t count, float *out) const
+{
+	if(!hasHeights()){
+		std::cerr << "terrain has no heights, none were loaded or MESH_DROP_ALL released them" << std::endl;
+		std::fill(out, out + count, 0.0f);
+		return;
+	}
+
+	size_t done = 0;
+#ifdef TERRAIN_AVX2
+	//a mapped raw heightmap is sampled one location at a time
+	if(heightSamples == NULL && __builtin_cpu_supports("avx2")){
+		done = sampleHeightsAvx2(heights.data(), imgWidth, imgHeight, xpos, ypos, count, out);
+	}
+#endif
+	for(size_t i = done; i < count; i++){
+		out[i] = sampleHeight(xpos[i], ypos[i]);
+	}
+}
+
+/* the terrain's normal, scaled by the terrain scale, at count locations at once */
+void Terrain::getNormals(const float *xpos, const float *ypos, size_t count, glm::vec3 *out) const
+{
+	if(!hasHeights()){
+		std::cerr << "terrain has no heights, none were loaded or MESH_DROP_ALL released them" << std::endl;
+		std::fill(out, out + count, glm::vec3(0.0f, 1.0f, 0.0f));
+		return;
+	}
+
+	size_t done = 0;
+#ifdef TERRAIN_AVX2
+	if(heightSamples == NULL && __builtin_cpu_supports("avx2")){
+		done = sampleNormalsAvx2(heights.data(), imgWidth, imgHeight, normalTransform, xpos, ypos, count, out);
+	}
+#endif
+	for(size_t i = done; i < count; i++){
+		out[i] = sampleNormal(xpos[i], ypos[i]);
+	}
+}
+
+/* getRotation for count locations at once, from getNormals 8 locations at a time so nothing is allocated */
+void Terrain::getRotations(const float *xpos, const float *ypos, size_t count, glm::vec2 *out) const
+{
+	//a flat normal turns into no rotation, checked here so the missing heights are reported once
+	if(!hasHeights()){
+		std::cerr << "terrain has no heights, none were loaded or MESH_DROP_ALL released them" << std::endl;
+		std::fill(out, out + count, glm::vec2(0.0f));
+		return;
+	}
+
+	glm::vec3 normals[8];
+	for(size_t block = 0; block < count; block += 8){
+		size_t n = std::min<size_t>(8, count - block);
+		getNormals(xpos + block, ypos + block, n, normals);
+		for(size_t i = 0; i < n; i++){
+			out[block + i] = glm::vec2(atan(normals[i].x/normals[i].y), atan(normals[i].z/normals[i].y));
+		}
+	}
+}
+
+/* a grid vertex's position, spread over [-1, 1] in x and z */
+glm::vec3 Terrain::gridPosition(int x, int y) const
+{
+	return glm::vec3(-1 + 2*x/(float)imgWidth, heightAt(x, y), -1 + 2*y/(float)imgHeight);
+}
+
+/*
+* a grid vertex's normal by central differences of the heights around it, one sided at the borders
+* read straight from the heights, so it holds after norBuf is freed or reordered by the voronoi split
+*/
+glm::vec3 Terrain::gridNormal(int x, int y) const
+{
+	int left = x > 0 ? x-1 : x;
+	int right = x < imgWidth - 1 ? x+1 : x;
+	int down = y > 0 ? y-1 : y;
+	int up = y < imgHeight - 1 ? y+1 : y;
+
+	//grid vertices are 2/w apart in x and 2/h apart in z
+	float spanX = 2.0f*(right - left)/imgWidth;
+	float spanZ = 2.0f*(up - down)/imgHeight;
+	float riseX = heightAt(right, y) - heightAt(left, y);
+	float riseZ = heightAt(x, up) - heightAt(x, down);
+
+	//cross product of the z and x tangents, (0, riseZ, spanZ) and (spanX, riseX, 0)
+	return glm::normalize(glm::vec3(-spanZ*riseX, spanX*spanZ, -spanX*riseZ));
+}
+
+/* fills norBuf from the heights in parallel over rows, instead of from the triangles */
+void Terrain::generateGridNormals()
+{
+	norBuf.resize(3*(size_t)imgWidth*imgHeight);
+	parallelFor(imgHeight, threadCount, [this](size_t begin, size_t end, unsigned int thread){
+		for(size_t y = begin; y < end; y++){
+			for(int x = 0; x < imgWidth; x++){
+				size_t i = y*imgWidth + x;
+				glm::vec3 normal = gridNormal(x, y);
+				norBuf[3*i] = normal.x;
+				norBuf[3*i+1] = normal.y;
+				norBuf[3*i+2] = normal.z;
+			}
+		}
+	});
+}
+
+void Terrain::setTerrainScale(float x, float y, float z)
+{
+	terrainScaleVec = glm::vec3(x, y, z);
+	normalTransform = glm::transpose(glm::inverse(glm::scale(glm::mat4(1.0f), terrainScaleVec)));
+}
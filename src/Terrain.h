@@ -1,51 +1,189 @@
-#pragma once
-#ifndef _TERRAIN_H_
-#define _TERRAIN_H_
-
-#include <string>
-#include <vector>
-#include <set>
-#include <memory>
-#include "Shape.h"
-
-#include <glm/gtc/type_ptr.hpp>
-
-class Program;
-
-class Terrain: public Shape
-{
-    public: 
-        void loadImage(const std::string &heightMap);
-        // void generateVoronoi();
-        // void init();
-        // void draw(const std::shared_ptr<Program> prog) const;
-        
-        //get's the height at a given location (between 0 an 1)
-        float getHeight(float xpos, float ypox);
-        glm::vec2 getRotation(float xpos, float ypox, glm::vec3 terrainScale);
-
-        void setTerrainScale(float x, float y, float z);
-        glm::vec3 getTerrainScale(){return terrainScaleVec;}
-
-    private:
-        glm::vec3 terrainScaleVec;
-        glm::mat4 normalTransform;
-
-        // std::vector<unsigned int> eleBuf;
-        // std::vector<float> posBuf;
-        // std::vector<float> norBuf;
-        // std::vector<float> texBuf;
-        // unsigned eleBufID;
-        // unsigned posBufID;
-        // unsigned norBufID;
-        // unsigned texBufID;
-        // unsigned vaoID;
-        // void generateNormals();
-
-
-	    // std::vector<struct VoronoiContainer> voronoiPieces;
-        // void drawVoronoi(const std::shared_ptr<Program> prog) const;
-        // bool usingVoronoi = false;
-};
-
+#pragma once
+#ifndef _TERRAIN_H_
+#define _TERRAIN_H_
+
+#include <string>
+#include <vector>
+#include <set>
+#include <memory>
+#include <utility>
+#include "Shape.h"
+#include "AlignedBuffer.h"
+
+#include <glm/gtc/type_ptr.hpp>
+
+class Program;
+class MappedFile;
+
+//quads along each side of a terrain chunk
+static const int TerrainChunkQuads = 32;
+
+//coarsest level of detail, a chunk drawn as one quad
+static const int TerrainMaxLod = 5;
+
+//a square block of the heightmap grid, its triangles are contiguous in eleBuf
+//a streamed grid has no eleBuf, its chunks are only drawn from the LOD patterns
+struct TerrainChunk
+{
+    glm::vec3 min;
+    glm::vec3 max;
+    unsigned int indexOffset;
+    unsigned int indexCount; //0 for a streamed grid
+    unsigned int baseVertex; //grid index of the chunk's first corner, LOD patterns are relative to it
+    int quadsX, quadsY;
+    int gridX, gridY;
+    int maxLevel; //coarsest level whose step divides the chunk's size
+    unsigned int patternBlock; //first of the 16*(maxLevel+1) LOD patterns for this chunk's size
+};
+
+//one level of detail for a chunk size, with the edges in its mask stitched to a neighbour one level coarser
+struct TerrainLodPattern
+{
+    unsigned int indexOffset;
+    unsigned int indexCount;
+};
+
+//quadtree node over the chunks, chunks are stored in tree order so every node's triangles are one range of eleBuf
+struct TerrainNode
+{
+    glm::vec3 min;
+    glm::vec3 max;
+    int children[4]; //-1 where there is no child
+    int chunk; //-1 for inner nodes
+    unsigned int indexOffset;
+    unsigned int indexCount;
+};
+
+class Terrain: public Shape
+{
+    public: 
+        Terrain();
+        ~Terrain();
+
+        void loadImage(const std::string &heightMap);
+        //a raw 16 bit heightmap, unsigned little endian samples with rows from the top like an image
+        //tileSize 0 stores rows one after another, otherwise the file is tileSize square tiles, left to right then
+        //top to bottom, each stored row by row and padded at the right and bottom edges
+        //the file is mapped rather than read and the queries sample it directly, with 65535 as height 1
+        //no mesh is kept on the CPU, init builds it from the mapping and uploads it a row of chunks at a time
+        //returns false if the file is missing or too small for the size given
+        bool loadRawHeightmap(const std::string &path, int width, int height, int tileSize = 0);
+        //takes another terrain's heights and grid mesh but not its chunks, for a terrain that is only going to be fractured
+        //other must still hold its CPU mesh, so call it before other's init
+        void copyGrid(const Terrain &other);
+        // void generateVoronoi();
+
+        //fractured terrain is optimized per cell by Shape, otherwise each chunk's triangles and, at init, the LOD
+        //patterns are reordered for the vertex cache, leaving the grid vertices where they are
+        void optimizeMesh();
+
+        //uploads the shape, or streams a raw heightmap's grid, and for terrain that is not fractured the LOD patterns,
+        //then applies the residency policy
+        //MESH_KEEP_QUERIES keeps the heights getHeight and getRotation read, MESH_DROP_ALL frees them too
+        void init();
+
+        //draws the chunks inside the cull matrix's frustum, fractured terrain is drawn by Shape per voronoi cell
+        void draw(const std::shared_ptr<Program> prog) const;
+
+        unsigned int getChunkCount() const { return chunks.size(); }
+        unsigned int getChunksDrawn() const { return chunksDrawn; }
+        size_t getTriangleCount() const { return streamedGrid ? (size_t)2*(imgWidth - 1)*(imgHeight - 1) : elementCount/3; }
+        size_t getTrianglesDrawn() const { return trianglesDrawn; }
+
+        //unfractured terrain picks a level of detail per chunk from its distance to the eye
+        void setLodEnabled(bool enabled) { lodEnabled = enabled; }
+        bool getLodEnabled() const { return lodEnabled; }
+        //eye in world space and the terrain's model matrix
+        void setLodCamera(const glm::vec3 &eye, const glm::mat4 &model) { lodEye = eye; lodModel = model; }
+        //a chunk drops a level each time its distance passes this many chunk sizes, doubled per level
+        void setLodDistance(float chunkSizes) { lodDistance = chunkSizes; }
+        
+        //get's the height at a given location (between 0 an 1)
+        float getHeight(float xpos, float ypox) const;
+        glm::vec2 getRotation(float xpos, float ypox, glm::vec3 terrainScale) const;
+        //the same queries for count locations (xpos[i], ypos[i]) at once, sampled 8 at a time with SIMD
+        void getHeights(const float *xpos, const float *ypos, size_t count, float *out) const;
+        void getNormals(const float *xpos, const float *ypos, size_t count, glm::vec3 *out) const;
+        void getRotations(const float *xpos, const float *ypos, size_t count, glm::vec2 *out) const;
+
+        void setTerrainScale(float x, float y, float z);
+        glm::vec3 getTerrainScale(){return terrainScaleVec;}
+
+    protected:
+        size_t cpuMeshBytes() const;
+        void releaseCpuMesh();
+
+    private:
+        //the height field, row y is heights[y*imgWidth, (y+1)*imgWidth), each terrain has its own
+        int imgWidth = 0, imgHeight = 0;
+        AlignedBuffer<float> heights;
+        //a raw heightmap is read through its mapping instead, heights is empty then
+        std::unique_ptr<MappedFile> heightFile;
+        const unsigned char *heightSamples = NULL;
+        int heightTileSize = 0;
+        bool hasHeights() const { return !heights.empty() || heightSamples != NULL; }
+        float heightAt(int x, int y) const;
+        void closeHeightFile();
+        void buildGrid();
+        bool streamedGrid = false; //the mesh is built from the mapping at init instead of into the buffers
+        void uploadStreamedGrid();
+
+        glm::vec3 terrainScaleVec = glm::vec3(1.0f);
+        glm::mat4 normalTransform = glm::mat4(1.0f);
+        glm::vec3 gridPosition(int x, int y) const;
+        glm::vec3 gridNormal(int x, int y) const;
+        float sampleHeight(float xpos, float ypos) const;
+        glm::vec3 sampleNormal(float xpos, float ypos) const;
+        void generateGridNormals();
+
+        std::vector<struct TerrainChunk> chunks;
+        std::vector<struct TerrainNode> nodes;
+        int gridWidth = 0;
+        int chunksX = 0, chunksY = 0;
+        std::vector<int> chunkGrid; //chunk index at gridY*chunksX + gridX
+        unsigned int layoutChunks();
+        int buildNode(int w, int x0, int y0, int x1, int y1, unsigned int &indexCount);
+        void chunkBounds(struct TerrainChunk &chunk) const;
+        void buildChunk(struct TerrainChunk &chunk);
+        void cullNode(int node, const struct Frustum &frustum) const;
+        mutable std::vector<int> visibleChunks; //reused every frame, in tree order
+        mutable std::vector<std::pair<unsigned int, unsigned int> > drawRanges; //index offset and count, reused every frame
+
+        bool lodEnabled = false;
+        float lodDistance = 2.0f;
+        glm::vec3 lodEye;
+        glm::mat4 lodModel;
+        std::vector<unsigned int> lodEleBuf;
+        std::vector<struct TerrainLodPattern> lodPatterns;
+        unsigned lodEleBufID = 0;
+        bool lodShortIndices = false;
+        bool lodCacheOptimized = false; //set by optimizeMesh so buildLodPatterns reorders the patterns too
+        void buildLodPatterns();
+        void buildLodPattern(int quadsX, int quadsY, int level, int mask);
+        void selectLevels() const;
+        void drawLod() const;
+        mutable std::vector<int> chunkLevels;
+        mutable std::vector<int> lodCounts;
+        mutable std::vector<const void *> lodOffsets;
+        mutable std::vector<int> lodBaseVertices;
+        mutable unsigned int chunksDrawn = 0;
+        mutable size_t trianglesDrawn = 0;
+
+        // std::vector<unsigned int> eleBuf;
+        // std::vector<float> posBuf;
+        // std::vector<float> norBuf;
+        // std::vector<float> texBuf;
+        // unsigned eleBufID;
+        // unsigned posBufID;
+        // unsigned norBufID;
+        // unsigned texBufID;
+        // unsigned vaoID;
+        // void generateNormals();
+
+
+	    // std::vector<struct VoronoiContainer> voronoiPieces;
+        // void drawVoronoi(const std::shared_ptr<Program> prog) const;
+        // bool usingVoronoi = false;
+};
+
 #endif
\ No newline at end of file
@@ -1,4 +1,7 @@
 #include <iostream>
+#include <thread>
+#include <cstring>
+#include <cctype>
 #include <glad/glad.h>
 
 #include "GLSL.h"
@@ -8,6 +11,8 @@
 #include "Texture.h"
 #include "WindowManager.h"
 #include "GLTextureWriter.h"
+#include "AllocationCounter.h"
+#include "MeshCache.h"
 
 // value_ptr for glm
 #include <glm/gtc/type_ptr.hpp>
@@ -51,8 +56,19 @@ public:
 	// Our shader program
 	std::shared_ptr<Program> prog;
 
-	//Terrain
+	// Uniforms set every frame, resolved once in init
+	UniformHandle h_P, h_M, h_V, h_eyePos, h_drawMode, h_fogMode, h_terrainTex;
+	UniformHandle h_pointLightPos, h_pointLightColor, h_dirLightVec, h_dirLightColor;
+
+	// Matrix stacks, reused every frame
+	shared_ptr<MatrixStack> P;
+	shared_ptr<MatrixStack> M;
+	shared_ptr<MatrixStack> V;
+
+	//Terrain, fractured into voronoi cells, and the same heightmap left whole and drawn in culled chunks
 	shared_ptr<Terrain> terrain;
+	shared_ptr<Terrain> wholeTerrain;
+	bool showWholeTerrain = false;
 	shared_ptr<Texture> terrainTex;
 	const vec3 terrainScale = vec3(100, 30, 100);
 	const vec3 terrainShift = vec3(0, -15, 0);
@@ -73,6 +89,10 @@ public:
 
 	double mouseOffsetX = 0, mouseOffsetY = 0;
 
+	//CPU time spent in render() since the stats were last printed
+	double frameTimeTotal = 0;
+	int frameCount = 0;
+
 	void keyCallback(GLFWwindow *window, int key, int scancode, int action, int mods)
 	{
 		if(key == GLFW_KEY_ESCAPE && action == GLFW_PRESS)
@@ -121,6 +141,27 @@ public:
 			curpos += cross(normalize(lookDir), vec3(0, 1, 0));
 		}
 
+		//cycle through the voronoi draw modes, printing stats for the mode being left
+		if (key == GLFW_KEY_B && action == GLFW_PRESS)
+		{
+			printFrameStats();
+			cycleDrawMode();
+		}
+
+		//switch between the fractured and the whole terrain
+		else if (key == GLFW_KEY_T && action == GLFW_PRESS)
+		{
+			printFrameStats();
+			showWholeTerrain = !showWholeTerrain;
+		}
+
+		//switch level of detail on the whole terrain
+		else if (key == GLFW_KEY_L && action == GLFW_PRESS)
+		{
+			printFrameStats();
+			wholeTerrain->setLodEnabled(!wholeTerrain->getLodEnabled());
+		}
+
 		//enable/disable fog effect
 		else if (key == GLFW_KEY_F && action == GLFW_PRESS)
 		{
@@ -128,6 +169,61 @@ public:
 		}
 	}
 
+	//per cell, then batched, then GPU animated
+	void cycleDrawMode()
+	{
+		if(terrain->getVoronoiDrawMode() == VORONOI_DRAW_PER_CELL){
+			terrain->setVoronoiDrawMode(VORONOI_DRAW_BATCHED);
+		}
+		else if(terrain->getVoronoiDrawMode() == VORONOI_DRAW_BATCHED){
+			terrain->setVoronoiDrawMode(VORONOI_DRAW_GPU_ANIMATED);
+		}
+		else{
+			terrain->setVoronoiDrawMode(VORONOI_DRAW_PER_CELL);
+		}
+	}
+
+	//the frame paths --check-allocations renders in turn, the voronoi draw modes then the whole terrain without and with LOD
+	static const int checkModes = 5;
+	void setCheckMode(int mode)
+	{
+		showWholeTerrain = mode >= 3;
+		if(showWholeTerrain){
+			wholeTerrain->setLodEnabled(mode == 4);
+		}
+		else{
+			terrain->setVoronoiDrawMode((VoronoiDrawMode)mode);
+		}
+	}
+
+	void recordFrameTime(double seconds)
+	{
+		frameTimeTotal += seconds;
+		frameCount++;
+	}
+
+	void printFrameStats()
+	{
+		if(frameCount == 0){
+			return;
+		}
+		if(showWholeTerrain){
+			cout << "whole terrain" << (wholeTerrain->getLodEnabled() ? " with LOD: " : ": ") << 1000.0 * frameTimeTotal / frameCount << " ms CPU per frame, "
+				<< wholeTerrain->getChunksDrawn() << "/" << wholeTerrain->getChunkCount() << " chunks, "
+				<< wholeTerrain->getTrianglesDrawn() << "/" << wholeTerrain->getTriangleCount() << " triangles, "
+				<< wholeTerrain->getDrawCallCount() << " draw calls" << endl;
+		}
+		else{
+			const char *modeNames[] = {"per cell", "batched", "GPU animated"};
+			cout << modeNames[terrain->getVoronoiDrawMode()] << " voronoi draw: "
+				<< 1000.0 * frameTimeTotal / frameCount << " ms CPU per frame, "
+				<< terrain->getCellsDrawn() << "/" << terrain->getCellCount() << " cells, "
+				<< terrain->getDrawCallCount() << " draw calls" << endl;
+		}
+		frameTimeTotal = 0;
+		frameCount = 0;
+	}
+
 	void scrollCallback(GLFWwindow* window, double deltaX, double deltaY)
 	{
 	}
@@ -156,6 +252,11 @@ public:
 		glfwSetInputMode(windowManager->getHandle(), GLFW_CURSOR, GLFW_CURSOR_DISABLED);
 		GLSL::checkVersion();
 
+		// Create the matrix stacks
+		P = make_shared<MatrixStack>();
+		M = make_shared<MatrixStack>();
+		V = make_shared<MatrixStack>();
+
 		// Set background color.
 		glClearColor(0, 0, 0, 1.0);
 		// Enable z-buffer test.
@@ -172,32 +273,40 @@ public:
 			std::cerr << "One or more shaders failed to compile... exiting!" << std::endl;
 			exit(1);
 		}
-		prog->addUniform("P");
-		prog->addUniform("M");
-		prog->addUniform("V");
+		h_P = prog->addUniform("P");
+		h_M = prog->addUniform("M");
+		h_V = prog->addUniform("V");
 		prog->addUniform("S");
-		prog->addUniform("drawMode");
-		prog->addUniform("fogMode");
-		prog->addUniform("eyePos");
+		h_drawMode = prog->addUniform("drawMode");
+		h_fogMode = prog->addUniform("fogMode");
+		h_eyePos = prog->addUniform("eyePos");
 		//material
 		prog->addUniform("MatAmb");
 		prog->addUniform("MatDif");
 		prog->addUniform("MatSpec");
 		prog->addUniform("shine");
 		//point light
-		prog->addUniform("pointLightPos");
-		prog->addUniform("pointLightColor");
+		h_pointLightPos = prog->addUniform("pointLightPos");
+		h_pointLightColor = prog->addUniform("pointLightColor");
 		//directional light
-		prog->addUniform("dirLightVec");
-		prog->addUniform("dirLightColor");
+		h_dirLightVec = prog->addUniform("dirLightVec");
+		h_dirLightColor = prog->addUniform("dirLightColor");
+		//batched and GPU animated voronoi cells
+		prog->addUniform("cellMode");
+		prog->addUniform("cellTransforms");
+		prog->addUniform("cellData");
+		prog->addUniform("animTime");
+		prog->addUniform("keyFrames");
+		prog->addUniform("keyFrameCount");
 
 		//vertex attributes
 		prog->addAttribute("vertPos");
 		prog->addAttribute("vertNor");
 		prog->addAttribute("vertTex");
+		prog->addAttribute("vertCell");
 
 
-		prog->addUniform("terrainTex");
+		h_terrainTex = prog->addUniform("terrainTex");
 	 }
 
 	void initGeom(const std::string& resourceDirectory)
@@ -209,13 +318,18 @@ public:
 	/* Initializes terrain*/
 	void initTerrain(const std::string& resourceDirectory)
 	{
-		//load in heighmap image
-		terrain = make_shared<Terrain>();
-		// terrain->loadImage(resourceDirectory + "/flat_flordia_heightmap.png");
-		terrain->loadImage(resourceDirectory + "/home_heightmap.png");
+		std::string heightMap = resourceDirectory + "/home_heightmap.png";
+		// std::string heightMap = resourceDirectory + "/flat_flordia_heightmap.png";
+
+		//the whole terrain has its own height field, so it loads on another thread while the fractured mesh is looked up
+		wholeTerrain = make_shared<Terrain>();
+		std::thread wholeTerrainLoader([this, heightMap](){
+			wholeTerrain->loadImage(heightMap);
+			wholeTerrain->optimizeMesh();
+		});
 
 		//create all the seeds for the voronoi containers
-		std::vector<glm::vec3> voronoiSeeds;
+		std::vector<float> seedX, seedZ;
 		int numAcross = 20;
 		int numPerArea = 5;
 		for(int x = 0; x < numAcross; x++){
@@ -223,20 +337,58 @@ public:
 				for(int i = 0; i < numPerArea; i++){
 					float wiggleX = rand() / float(RAND_MAX);
 					float wiggleZ = rand() / float(RAND_MAX);
-					float xPos = -1 + x*(2.0/numAcross) + (wiggleX * 2.0/numAcross);
-					float zPos = -1 + z*(2.0/numAcross) + (wiggleZ * 2.0/numAcross);
-					voronoiSeeds.push_back(vec3(xPos, terrain->getHeight(xPos, zPos), zPos));
+					seedX.push_back(-1 + x*(2.0/numAcross) + (wiggleX * 2.0/numAcross));
+					seedZ.push_back(-1 + z*(2.0/numAcross) + (wiggleZ * 2.0/numAcross));
 				}
 			}
 		}
 
-		//generate all voronoi cells and enable the animation
+		//the fractured mesh only depends on the heightmap, the seeds and the animation, so it is cached under a hash of them
+		std::string meshCachePath = resourceDirectory + "/home_heightmap.voronoi";
+		//without the heightmap's contents in the key a stale cache could be loaded, so it is not used at all then
+		MeshCacheKey cacheKey;
+		bool useCache = cacheKey.addFile(heightMap);
+		cacheKey.addBytes(&seedX[0], seedX.size()*sizeof(float));
+		cacheKey.addBytes(&seedZ[0], seedZ.size()*sizeof(float));
+		cacheKey.addFunction(&outSpeedUpAnimation);
+
+		terrain = make_shared<Terrain>();
 		terrain->setAnimationFunction(&outSpeedUpAnimation);
-		terrain->generateVoronoi(voronoiSeeds);
+		if(!useCache || !terrain->loadVoronoiCache(meshCachePath, cacheKey.value())){
+			//start from the whole terrain's grid instead of decoding and meshing the heightmap a second time
+			//the seed heights are looked up in one batch
+			wholeTerrainLoader.join();
+			terrain->copyGrid(*wholeTerrain);
+			std::vector<float> seedHeights(seedX.size());
+			terrain->getHeights(&seedX[0], &seedZ[0], seedX.size(), &seedHeights[0]);
+			std::vector<glm::vec3> voronoiSeeds;
+			for(unsigned int i = 0; i < seedX.size(); i++){
+				voronoiSeeds.push_back(vec3(seedX[i], seedHeights[i], seedZ[i]));
+			}
+
+			//generate all voronoi cells and enable the animation
+			terrain->generateVoronoi(voronoiSeeds);
+			terrain->optimizeMesh();
+			if(useCache){
+				terrain->saveVoronoiCache(meshCachePath, cacheKey.value());
+			}
+		}
 
-		//initialize openGL buffers
+		//initialize openGL buffers, interleaved and quantized to save GPU memory
+		//nothing reads the fractured mesh back after this, so none of it is kept on the CPU
+		terrain->setPackedVertices(true);
+		terrain->setResidency(MESH_DROP_ALL);
 		terrain->init();
 
+		//GL calls stay on this thread
+		if(wholeTerrainLoader.joinable()){
+			wholeTerrainLoader.join();
+		}
+		wholeTerrain->setPackedVertices(true);
+		wholeTerrain->setLodEnabled(true);
+		wholeTerrain->setResidency(MESH_KEEP_QUERIES);
+		wholeTerrain->init();
+
 		//initialize the texture
 		terrainTex = make_shared<Texture>();
 		terrainTex->initDataFromFile(resourceDirectory + "/graphiti_texture.jpg");
@@ -247,11 +399,11 @@ public:
 
 	void setupLights()
 	{
-		glUniform3f(prog->getUniform("pointLightPos"), 0, 0, 0);
-		glUniform3f(prog->getUniform("pointLightColor"), 0.3, 0.3, 0.3);
+		glUniform3f(prog->getUniform(h_pointLightPos), 0, 0, 0);
+		glUniform3f(prog->getUniform(h_pointLightColor), 0.3, 0.3, 0.3);
 
-		glUniform3f(prog->getUniform("dirLightVec"), -0.56, 0.5, 0.66);
-		glUniform3f(prog->getUniform("dirLightColor"), 0.7, 0.7, 0.7);
+		glUniform3f(prog->getUniform(h_dirLightVec), -0.56, 0.5, 0.66);
+		glUniform3f(prog->getUniform(h_dirLightColor), 0.7, 0.7, 0.7);
 	}
 
 	void render()
@@ -267,10 +419,10 @@ public:
 		/* Leave this code to just draw the meshes alone */
 		float aspect = width/(float)height;
 
-		// Create the matrix stacks
-		auto P = make_shared<MatrixStack>();
-		auto M = make_shared<MatrixStack>();
-		auto V = make_shared<MatrixStack>();
+		// Reset the matrix stacks
+		P->loadIdentity();
+		M->loadIdentity();
+		V->loadIdentity();
 		// Apply perspective projection.
 		P->pushMatrix();
 		P->perspective(45.0f, aspect, 0.01f, 2000.0f);
@@ -283,11 +435,11 @@ public:
 
 		//draw all the meshes
 		prog->bind();
-		glUniformMatrix4fv(prog->getUniform("P"), 1, GL_FALSE, value_ptr(P->topMatrix()));
-		glUniformMatrix4fv(prog->getUniform("V"), 1, GL_FALSE,value_ptr(V->topMatrix()) );
-		glUniform3f(prog->getUniform("eyePos"), curpos.x, curpos.y, curpos.z);
-		glUniform1i(prog->getUniform("drawMode"), drawMode);
-		glUniform1i(prog->getUniform("fogMode"), fogMode);
+		glUniformMatrix4fv(prog->getUniform(h_P), 1, GL_FALSE, value_ptr(P->topMatrix()));
+		glUniformMatrix4fv(prog->getUniform(h_V), 1, GL_FALSE,value_ptr(V->topMatrix()) );
+		glUniform3f(prog->getUniform(h_eyePos), curpos.x, curpos.y, curpos.z);
+		glUniform1i(prog->getUniform(h_drawMode), drawMode);
+		glUniform1i(prog->getUniform(h_fogMode), fogMode);
 		setupLights();
 
 		M->pushMatrix();
@@ -297,14 +449,23 @@ public:
 			M->pushMatrix();
 			M->translate(terrainShift);
 			M->scale(terrainScale);
-			terrainTex->bind(prog->getUniform("terrainTex"));
+			terrainTex->bind(prog->getUniform(h_terrainTex));
 			int d = drawMode;
 			drawMode = 2;
-			glUniform1i(prog->getUniform("drawMode"), drawMode);
-			glUniformMatrix4fv(prog->getUniform("M"), 1, GL_FALSE,value_ptr(M->topMatrix()) );
-			terrain->draw(prog);
+			glUniform1i(prog->getUniform(h_drawMode), drawMode);
+			glUniformMatrix4fv(prog->getUniform(h_M), 1, GL_FALSE,value_ptr(M->topMatrix()) );
+			mat4 clip = P->topMatrix() * V->topMatrix() * M->topMatrix();
+			if(showWholeTerrain){
+				wholeTerrain->setCullMatrix(clip);
+				wholeTerrain->setLodCamera(curpos, M->topMatrix());
+				wholeTerrain->draw(prog);
+			}
+			else{
+				terrain->setCullMatrix(clip);
+				terrain->draw(prog);
+			}
 			drawMode = d;
-			glUniform1i(prog->getUniform("drawMode"), drawMode);
+			glUniform1i(prog->getUniform(h_drawMode), drawMode);
 			M->popMatrix();
 
 		M->popMatrix();
@@ -320,10 +481,30 @@ int main(int argc, char **argv)
 {
 	// Where the resources are loaded from
 	std::string resourceDir = "../resources";
+	// With --check-allocations [frames] every voronoi draw mode and the whole terrain with and without LOD are rendered for
+	// that many frames after a warm up, then the program exits with status 1 if any of those frames allocated.
+	// Needs a build with COUNT_ALLOCATIONS
+	int checkFrames = 0;
 
-	if (argc >= 2)
+	for (int i = 1; i < argc; i++)
 	{
-			resourceDir = argv[1];
+		if (strcmp(argv[i], "--check-allocations") == 0)
+		{
+			checkFrames = 100;
+			if (i + 1 < argc && isdigit((unsigned char)argv[i + 1][0]))
+			{
+				checkFrames = atoi(argv[++i]);
+			}
+		}
+		else
+		{
+			resourceDir = argv[i];
+		}
+	}
+	if (checkFrames > 0 && !AllocationCounter::enabled())
+	{
+		std::cerr << "--check-allocations needs a build with COUNT_ALLOCATIONS (cmake -DCOUNT_ALLOCATIONS=ON)" << std::endl;
+		return 2;
 	}
 
 	Application *application = new Application();
@@ -341,12 +522,45 @@ int main(int argc, char **argv)
 
 	application->init(resourceDir);
 	application->initGeom(resourceDir);
+	if (checkFrames > 0)
+	{
+		application->setCheckMode(0);
+	}
 
 	// Loop until the user closes the window.
+	// The first frames in a draw mode set up per frame buffers, after that rendering should not allocate
+	const int warmupFrames = 3;
+	int frame = 0;
+	int modeFrame = 0;
+	int modesChecked = 0;
+	unsigned long long steadyAllocations = 0;
 	while (! glfwWindowShouldClose(windowManager->getHandle()))
 	{
 			// Render scene.
+			AllocationCounter::beginFrame();
+			double frameStart = glfwGetTime();
 			application->render();
+			application->recordFrameTime(glfwGetTime() - frameStart);
+			unsigned long long frameAllocs = AllocationCounter::endFrame();
+			if (modeFrame >= warmupFrames && frameAllocs != 0)
+			{
+				std::cerr << "frame " << frame << " made " << frameAllocs << " heap allocations" << std::endl;
+				steadyAllocations += frameAllocs;
+			}
+			frame++;
+			modeFrame++;
+
+			if (checkFrames > 0 && modeFrame == warmupFrames + checkFrames)
+			{
+				application->printFrameStats();
+				modesChecked++;
+				if (modesChecked == Application::checkModes)
+				{
+					break;
+				}
+				application->setCheckMode(modesChecked);
+				modeFrame = 0;
+			}
 
 			// Swap front and back buffers.
 			glfwSwapBuffers(windowManager->getHandle());
@@ -354,7 +568,14 @@ int main(int argc, char **argv)
 			glfwPollEvents();
 	}
 
+	int status = 0;
+	if (checkFrames > 0)
+	{
+		std::cout << steadyAllocations << " heap allocations in " << modesChecked * checkFrames << " steady state frames" << std::endl;
+		status = (modesChecked == Application::checkModes && steadyAllocations == 0) ? 0 : 1;
+	}
+
 	// Quit program.
 	windowManager->shutdown();
-	return 0;
+	return status;
 }